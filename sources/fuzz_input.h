@@ -0,0 +1,61 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Helpers of the fuzz targets, which call the plugin directly like the host.
+
+#pragma once
+extern "C" {
+#include <ip.h>
+}
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace fuzz_input {
+
+// the host passes a descriptor, so the input goes in an anonymous file
+inline int open_memory(const std::uint8_t *data, std::size_t size)
+{
+    int fd = memfd_create("fuzz-input", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count <= 0) {
+            close(fd);
+            return -1;
+        }
+        data += count;
+        size -= count;
+    }
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool set_option(const char *name, const char *value)
+{
+    for (const input_plugin_opt *opt = ip_options; opt->name; ++opt) {
+        if (!strcmp(opt->name, name))
+            return opt->set(value) == 0;
+    }
+    return false;
+}
+
+// the name only matters to prewarming, which looks for the next file by name
+inline void init(input_plugin_data &ip_data, int fd)
+{
+    static char filename[] = "fuzz-input.vgm";
+    memset(&ip_data, 0, sizeof(ip_data));
+    ip_data.filename = filename;
+    ip_data.fd = fd;
+}
+
+} // namespace fuzz_input
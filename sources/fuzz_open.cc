@@ -0,0 +1,40 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// libFuzzer target of the opening of files: the decompression of VGZ, the
+// parsing of headers and tags by libvgm, and the first render which estimates
+// the cost of a track. The input is the file.
+
+#include "fuzz_input.h"
+extern "C" {
+#include <comment.h>
+}
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    // no background work which would outlive the input
+    fuzz_input::set_option("prewarm", "false");
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size)
+{
+    int fd = fuzz_input::open_memory(data, size);
+    if (fd == -1)
+        return 0;
+
+    input_plugin_data ip_data;
+    fuzz_input::init(ip_data, fd);
+    if (ip_ops.open(&ip_data) == 0) {
+        struct keyval *comments = nullptr;
+        if (ip_ops.read_comments(&ip_data, &comments) == 0)
+            keyvals_free(comments);
+        ip_ops.duration(&ip_data);
+        ip_ops.close(&ip_data);
+    }
+
+    close(fd);
+    return 0;
+}
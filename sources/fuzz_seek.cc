@@ -0,0 +1,71 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// libFuzzer target of playback: random sequences of reads and seeks, under
+// random settings, over the loop cache, the fade and the stems.
+//
+// The input starts with a byte of settings, and a byte counting the
+// operations, which follow as three bytes each: a kind and a 16-bit
+// argument. The rest of the input is the file.
+//
+//   settings: bit 0 stems, bit 1 no loop cache, bits 2-3 max_loops - 1
+//   read:     kind even, argument in frames
+//   seek:     kind odd, argument in hundredths of a second, past the end too
+
+#include "fuzz_input.h"
+#include <vector>
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    // no background work which would outlive the input
+    fuzz_input::set_option("prewarm", "false");
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size)
+{
+    if (size < 2)
+        return 0;
+    unsigned settings = data[0];
+    std::size_t opcount = data[1];
+    data += 2;
+    size -= 2;
+    if (size < 3 * opcount)
+        return 0;
+    const std::uint8_t *ops = data;
+    data += 3 * opcount;
+    size -= 3 * opcount;
+
+    const char maxloops[] = {char('1' + ((settings >> 2) & 3)), '\0'};
+    fuzz_input::set_option("stems", (settings & 1) ? "true" : "false");
+    fuzz_input::set_option("loop_cache", (settings & 2) ? "false" : "true");
+    fuzz_input::set_option("max_loops", maxloops);
+
+    int fd = fuzz_input::open_memory(data, size);
+    if (fd == -1)
+        return 0;
+
+    input_plugin_data ip_data;
+    fuzz_input::init(ip_data, fd);
+    if (ip_ops.open(&ip_data) == 0) {
+        int framesize = sf_get_frame_size(ip_data.sf);
+        std::vector<char> buffer;
+        for (std::size_t i = 0; i < opcount; ++i) {
+            const std::uint8_t *op = &ops[3 * i];
+            unsigned arg = op[1] | (op[2] << 8);
+            if ((op[0] & 1) == 0) {
+                buffer.resize((std::size_t)(arg + 1) * framesize);
+                if (ip_ops.read(&ip_data, buffer.data(), buffer.size()) < 0)
+                    break;
+            }
+            else if (ip_ops.seek(&ip_data, arg * 0.01) != 0)
+                break;
+        }
+        ip_ops.close(&ip_data);
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,74 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// The functions of the host which the plugin calls, for the programs which run
+// the plugin outside of cmus: the training workload, the fuzz targets and the
+// soak test. Debug messages are printed if CMUS_VGM_DEBUG is set.
+
+extern "C" {
+#include <comment.h>
+#include <xmalloc.h>
+#include <debug.h>
+}
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+
+extern "C" {
+
+void _debug_print(const char *function, const char *fmt, ...)
+{
+    if (!getenv("CMUS_VGM_DEBUG"))
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "%s: ", function);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void malloc_fail(void)
+{
+    fprintf(stderr, "out of memory\n");
+    abort();
+}
+
+void keyvals_add(struct growing_keyvals *c, const char *key, char *val)
+{
+    if (c->count == c->alloc) {
+        c->alloc = c->alloc ? 2 * c->alloc : 8;
+        c->keyvals = (struct keyval *)xrealloc(c->keyvals, c->alloc * sizeof(struct keyval));
+    }
+    c->keyvals[c->count].key = xstrdup(key);
+    c->keyvals[c->count].val = val;
+    ++c->count;
+}
+
+void keyvals_terminate(struct growing_keyvals *c)
+{
+    if (c->count == c->alloc) {
+        c->alloc = c->count + 1;
+        c->keyvals = (struct keyval *)xrealloc(c->keyvals, c->alloc * sizeof(struct keyval));
+    }
+    c->keyvals[c->count].key = nullptr;
+    c->keyvals[c->count].val = nullptr;
+}
+
+void keyvals_free(struct keyval *keyvals)
+{
+    for (struct keyval *kv = keyvals; kv && kv->key; ++kv) {
+        free(kv->key);
+        free(kv->val);
+    }
+    free(keyvals);
+}
+
+int comments_add_const(struct growing_keyvals *c, const char *key, const char *val)
+{
+    keyvals_add(c, key, xstrdup(val));
+    return 1;
+}
+
+} // extern "C"
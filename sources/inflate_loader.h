@@ -0,0 +1,231 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <utils/DataLoader.h>
+#include <zlib.h>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Data loader which inflates a compressed memory range on demand, so the
+// decompressed data goes directly into the buffer of the loader.
+// `window_bits` is as in `inflateInit2`: -15 for raw deflate, 15+16 for gzip.
+// Gzip members which follow one another are read as one stream, and data
+// after the last member is ignored, as `gzread` does.
+//
+// The players read the whole file when they load it, and never seek the
+// loader afterwards, so a seek simply inflates again from the start if it
+// goes backward. The inflate state is freed as soon as the end is read, so
+// a loaded file holds only its decompressed data.
+DATA_LOADER *InflateLoader_Init(const UINT8 *data, size_t size, UINT32 length, int window_bits);
+
+//------------------------------------------------------------------------------
+struct inflate_loader {
+    z_stream stream {};
+    bool stream_init = false;
+    bool eof = false;
+    int window_bits = 0;
+    const UINT8 *data = nullptr;
+    size_t size = 0;
+    UINT32 length = 0;
+    UINT32 pos = 0;
+};
+
+static UINT8 InflateLoader_dopen(void *context)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+
+    if (ctx->stream_init) {
+        if (inflateReset(&ctx->stream) != Z_OK)
+            return 0x01;
+    }
+    else {
+        if (inflateInit2(&ctx->stream, ctx->window_bits) != Z_OK)
+            return 0x01;
+        ctx->stream_init = true;
+    }
+
+    ctx->stream.next_in = (Bytef *)ctx->data;
+    ctx->stream.avail_in = (uInt)ctx->size;
+    ctx->eof = false;
+    ctx->pos = 0;
+    return 0x00;
+}
+
+static UINT8 InflateLoader_dclose(void *context);
+
+// Whether another gzip member starts at the input of a stream which ended.
+inline bool gzip_member_follows(const z_stream &stream, int window_bits)
+{
+    return window_bits > 15 && stream.avail_in >= 2 &&
+        stream.next_in[0] == 0x1f && stream.next_in[1] == 0x8b;
+}
+
+static UINT32 InflateLoader_dread(void *context, UINT8 *buffer, UINT32 numBytes)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+
+    if (ctx->eof || !ctx->stream_init)
+        return 0;
+
+    z_stream &stream = ctx->stream;
+    stream.next_out = buffer;
+    stream.avail_out = numBytes;
+
+    while (stream.avail_out > 0) {
+        int err = inflate(&stream, Z_NO_FLUSH);
+        if (err == Z_STREAM_END && gzip_member_follows(stream, ctx->window_bits)) {
+            if (inflateReset(&stream) == Z_OK)
+                continue;
+        }
+        if (err != Z_OK || (stream.avail_in == 0 && stream.avail_out > 0)) {
+            ctx->eof = true;  // end of stream, truncated or corrupt data
+            break;
+        }
+    }
+
+    UINT32 count = numBytes - stream.avail_out;
+    ctx->pos += count;
+    if (ctx->eof || ctx->pos >= ctx->length)
+        InflateLoader_dclose(ctx);
+    return count;
+}
+
+static UINT8 InflateLoader_dseek(void *context, UINT32 offset, UINT8 whence)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+
+    if (whence == SEEK_CUR)
+        offset += ctx->pos;
+    else if (whence == SEEK_END)
+        offset += ctx->length;
+
+    if ((offset < ctx->pos || !ctx->stream_init) && InflateLoader_dopen(ctx) != 0x00)
+        return 0x01;
+
+    UINT8 buffer[8192];
+    while (ctx->pos < offset) {
+        UINT32 count = offset - ctx->pos;
+        if (count > sizeof(buffer))
+            count = sizeof(buffer);
+        if (InflateLoader_dread(ctx, buffer, count) != count)
+            return 0x01;
+    }
+    return 0x00;
+}
+
+static UINT8 InflateLoader_dclose(void *context)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+
+    if (ctx->stream_init) {
+        inflateEnd(&ctx->stream);
+        ctx->stream_init = false;
+    }
+    return 0x00;
+}
+
+static INT32 InflateLoader_dtell(void *context)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+    return (INT32)ctx->pos;
+}
+
+static UINT32 InflateLoader_dlength(void *context)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+    return ctx->length;
+}
+
+static UINT8 InflateLoader_deof(void *context)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+    return ctx->eof || ctx->pos >= ctx->length;
+}
+
+static UINT8 InflateLoader_ddeinit(void *context)
+{
+    inflate_loader *ctx = (inflate_loader *)context;
+    InflateLoader_dclose(ctx);
+    delete ctx;
+    return 0x00;
+}
+
+static const DATA_LOADER_CALLBACKS inflateLoader = {
+    0x5A4C4942,  // "ZLIB"
+    "Inflate Loader",
+    &InflateLoader_dopen,
+    &InflateLoader_dread,
+    &InflateLoader_dseek,
+    &InflateLoader_dclose,
+    &InflateLoader_dtell,
+    &InflateLoader_dlength,
+    &InflateLoader_deof,
+    &InflateLoader_ddeinit,
+};
+
+inline DATA_LOADER *InflateLoader_Init(const UINT8 *data, size_t size, UINT32 length, int window_bits)
+{
+    DATA_LOADER *loader = (DATA_LOADER *)calloc(1, sizeof(DATA_LOADER));
+    if (!loader)
+        return nullptr;
+
+    inflate_loader *ctx = new (std::nothrow) inflate_loader;
+    if (!ctx) {
+        free(loader);
+        return nullptr;
+    }
+
+    ctx->window_bits = window_bits;
+    ctx->data = data;
+    ctx->size = size;
+    ctx->length = length;
+
+    DataLoader_Setup(loader, &inflateLoader, ctx);
+    return loader;
+}
+
+// Memory of the inflate state while loading, as zconf.h gives it: the window
+// of 32 KiB, and about 7 KiB of tables.
+static constexpr size_t inflate_state_size = (1 << 15) + 7 * 1024;
+
+// Counts the decompressed size of gzip data, by inflating it without keeping
+// the output. The trailers cannot give it: theirs is modulo 2^32, covers one
+// member only, and is not checked against the data until the end.
+// Fails if the data is truncated, corrupt, or inflates to more than `limit`.
+inline bool gzip_inflated_size(const UINT8 *data, size_t size, UINT32 limit, UINT32 &length)
+{
+    z_stream stream {};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+        return false;
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)size;
+
+    UINT8 buffer[16384];
+    UINT64 total = 0;
+    bool ok = false;
+    for (;;) {
+        stream.next_out = buffer;
+        stream.avail_out = sizeof(buffer);
+        int err = inflate(&stream, Z_NO_FLUSH);
+        total += sizeof(buffer) - stream.avail_out;
+        if (total > limit)
+            break;
+        if (err == Z_STREAM_END) {
+            if (gzip_member_follows(stream, 15 + 16) && inflateReset(&stream) == Z_OK)
+                continue;
+            ok = true;
+            break;
+        }
+        if (err != Z_OK)
+            break;
+    }
+    inflateEnd(&stream);
+
+    length = (UINT32)total;
+    return ok;
+}
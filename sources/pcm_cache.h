@@ -0,0 +1,369 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include "mapped_file.h"
+#include <player/playerbase.hpp>
+#include <zlib.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+// Rendered frames stored on disk, losslessly compressed in blocks which can
+// be decoded independently, for seeking. Each block holds the differences of
+// consecutive samples per channel, deflated. The file ends with the offsets
+// of the blocks, followed by a fixed-size footer.
+//
+// A file is written under a temporary name, which the writer keeps locked,
+// and renamed when complete. The directory is bounded in size by removing
+// the least recently used files, which readers mark by touching them.
+namespace pcm_cache {
+
+static constexpr char magic[8] = {'V', 'G', 'M', 'P', 'C', 'M', '0', '1'};
+static constexpr UINT32 block_frames = 65536;
+static constexpr char temp_prefix[] = ".vgmpcm.";
+static constexpr char suffix[] = ".vgmpcm";
+
+struct footer {
+    char magic[8];
+    UINT64 frames;
+    UINT32 block_frames;
+    UINT32 block_count;
+};
+
+// 64-bit FNV-1a, to key the cache on the contents of files
+inline UINT64 hash(const void *data, size_t size, UINT64 h = 0xcbf29ce484222325)
+{
+    const UINT8 *p = (const UINT8 *)data;
+    for (size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 0x100000001b3;
+    return h;
+}
+
+// marks a file as recently used
+inline void touch(const std::string &path)
+{
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+}
+
+// removes the temporary files which no writer holds, left over by a crash
+inline void remove_stale(const std::string &dir)
+{
+    DIR *dh = opendir(dir.c_str());
+    if (!dh)
+        return;
+    while (dirent *ent = readdir(dh)) {
+        if (strncmp(ent->d_name, temp_prefix, sizeof(temp_prefix) - 1) != 0)
+            continue;
+        std::string path = dir + "/" + ent->d_name;
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            unlink(path.c_str());
+        ::close(fd);
+    }
+    closedir(dh);
+}
+
+// removes the least recently used files until the directory fits the size
+inline void prune(const std::string &dir, UINT64 max_size)
+{
+    DIR *dh = opendir(dir.c_str());
+    if (!dh)
+        return;
+
+    struct entry {
+        std::string path;
+        UINT64 size;
+        struct timespec mtime;
+    };
+    std::vector<entry> entries;
+    UINT64 total = 0;
+
+    size_t suffix_len = sizeof(suffix) - 1;
+    while (dirent *ent = readdir(dh)) {
+        size_t len = strlen(ent->d_name);
+        if (len <= suffix_len || ent->d_name[0] == '.' ||
+            memcmp(ent->d_name + len - suffix_len, suffix, suffix_len) != 0)
+            continue;
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        entries.push_back(entry{std::move(path), (UINT64)st.st_size, st.st_mtim});
+        total += st.st_size;
+    }
+    closedir(dh);
+
+    if (total <= max_size)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+        return a.mtime.tv_sec != b.mtime.tv_sec ?
+            a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec; });
+    for (size_t i = 0; i < entries.size() && total > max_size; ++i) {
+        if (unlink(entries[i].path.c_str()) == 0 || errno == ENOENT)
+            total -= entries[i].size;
+    }
+}
+
+//------------------------------------------------------------------------------
+struct writer {
+    writer() {}
+    ~writer() { abort(); }
+    bool open(const std::string &dir);
+    bool write(const WAVE_32BS *data, UINT32 count);
+    bool commit(const std::string &path);
+    void abort();
+
+    bool is_open() const { return fd_ != -1; }
+    UINT64 frames() const { return frames_; }
+
+private:
+    int fd_ = -1;
+    std::string temp_path_;
+    UINT64 frames_ = 0;
+    std::vector<WAVE_32BS> block_;
+    std::vector<UINT64> offsets_;
+    std::vector<Bytef> zbuf_;
+
+    bool flush_block();
+    bool write_all(const void *data, size_t size);
+    writer(const writer &) = delete;
+    writer &operator=(const writer &) = delete;
+};
+
+inline bool writer::open(const std::string &dir)
+{
+    abort();
+    remove_stale(dir);
+
+    std::string path = dir + "/" + temp_prefix + "XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd == -1)
+        return false;
+    // held until closed, so that other instances know it is in use
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    fd_ = fd;
+    temp_path_ = std::move(path);
+    frames_ = 0;
+    block_.clear();
+    block_.reserve(block_frames);
+    offsets_.assign(1, 0);
+    return true;
+}
+
+inline bool writer::write(const WAVE_32BS *data, UINT32 count)
+{
+    while (count > 0) {
+        UINT32 n = std::min<UINT32>(count, block_frames - block_.size());
+        block_.insert(block_.end(), data, data + n);
+        data += n;
+        count -= n;
+        frames_ += n;
+        if (block_.size() == block_frames && !flush_block())
+            return false;
+    }
+    return true;
+}
+
+inline bool writer::commit(const std::string &path)
+{
+    if (fd_ == -1 || (!block_.empty() && !flush_block()))
+        return false;
+
+    footer ft;
+    memcpy(ft.magic, magic, sizeof(magic));
+    ft.frames = frames_;
+    ft.block_frames = block_frames;
+    ft.block_count = offsets_.size() - 1;
+
+    if (!write_all(offsets_.data(), offsets_.size() * sizeof(UINT64)) ||
+        !write_all(&ft, sizeof(ft)) || ::close(fd_) != 0)
+    {
+        fd_ = -1;
+        abort();
+        return false;
+    }
+    fd_ = -1;
+
+    bool ok = rename(temp_path_.c_str(), path.c_str()) == 0;
+    if (!ok)
+        unlink(temp_path_.c_str());
+    temp_path_.clear();
+    return ok;
+}
+
+inline void writer::abort()
+{
+    if (fd_ != -1) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    if (!temp_path_.empty()) {
+        unlink(temp_path_.c_str());
+        temp_path_.clear();
+    }
+    std::vector<WAVE_32BS>().swap(block_);
+    std::vector<Bytef>().swap(zbuf_);
+}
+
+inline bool writer::flush_block()
+{
+    INT32 *samples = (INT32 *)block_.data();
+    size_t count = 2 * block_.size();
+
+    for (size_t i = count; i-- > 2;)
+        samples[i] = (INT32)((UINT32)samples[i] - (UINT32)samples[i - 2]);
+
+    uLongf zsize = compressBound(count * sizeof(INT32));
+    zbuf_.resize(zsize);
+    bool ok = compress2(zbuf_.data(), &zsize, (const Bytef *)samples, count * sizeof(INT32), 1) == Z_OK &&
+        write_all(zbuf_.data(), zsize);
+
+    block_.clear();
+    if (!ok) {
+        abort();
+        return false;
+    }
+    offsets_.push_back(offsets_.back() + zsize);
+    return true;
+}
+
+inline bool writer::write_all(const void *data, size_t size)
+{
+    const UINT8 *p = (const UINT8 *)data;
+    while (size > 0) {
+        ssize_t n = ::write(fd_, p, size);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+struct reader {
+    bool open(const std::string &path);
+    UINT32 read(UINT64 pos, WAVE_32BS *data, UINT32 count);
+
+    UINT64 frames() const { return frames_; }
+
+private:
+    mapped_file map_;
+    UINT64 frames_ = 0;
+    UINT32 block_count_ = 0;
+    const UINT8 *index_ = nullptr; // unaligned, it follows the blocks directly
+    std::vector<WAVE_32BS> block_;
+    UINT32 block_index_ = (UINT32)-1;
+
+    bool decode_block(UINT32 index);
+    UINT64 offset(UINT32 index) const;
+};
+
+inline bool reader::open(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    bool mapped = map_.open(fd);
+    ::close(fd);
+    if (!mapped)
+        return false;
+
+    const UINT8 *data = (const UINT8 *)map_.data();
+    size_t size = map_.size();
+
+    footer ft;
+    if (size < sizeof(ft))
+        return false;
+    memcpy(&ft, data + size - sizeof(ft), sizeof(ft));
+    size_t index_size = ((size_t)ft.block_count + 1) * sizeof(UINT64);
+    if (memcmp(ft.magic, magic, sizeof(magic)) != 0 || ft.block_frames != block_frames ||
+        ft.block_count != (ft.frames + block_frames - 1) / block_frames ||
+        index_size > size - sizeof(ft))
+        return false;
+
+    index_ = data + size - sizeof(ft) - index_size;
+    block_count_ = ft.block_count;
+    if (offset(ft.block_count) != size - sizeof(ft) - index_size) {
+        index_ = nullptr;
+        block_count_ = 0;
+        return false;
+    }
+
+    frames_ = ft.frames;
+    return true;
+}
+
+inline UINT64 reader::offset(UINT32 index) const
+{
+    UINT64 value;
+    memcpy(&value, index_ + (size_t)index * sizeof(UINT64), sizeof(UINT64));
+    return value;
+}
+
+inline UINT32 reader::read(UINT64 pos, WAVE_32BS *data, UINT32 count)
+{
+    UINT32 got = 0;
+    while (got < count && pos < frames_) {
+        UINT32 index = pos / block_frames;
+        if (index != block_index_ && !decode_block(index))
+            break;
+        UINT32 offset = pos % block_frames;
+        UINT32 n = std::min<UINT64>(count - got, block_.size() - offset);
+        std::copy_n(&block_[offset], n, &data[got]);
+        got += n;
+        pos += n;
+    }
+    return got;
+}
+
+inline bool reader::decode_block(UINT32 index)
+{
+    block_index_ = (UINT32)-1;
+    if (index >= block_count_)
+        return false;
+    UINT64 begin = offset(index), end = offset(index + 1);
+    if (begin > end || end > offset(block_count_))
+        return false;
+
+    UINT32 frames = std::min<UINT64>(block_frames, frames_ - (UINT64)index * block_frames);
+    block_.resize(frames);
+
+    uLongf size = frames * sizeof(WAVE_32BS);
+    const Bytef *src = (const Bytef *)map_.data() + begin;
+    if (uncompress((Bytef *)block_.data(), &size, src, end - begin) != Z_OK ||
+        size != frames * sizeof(WAVE_32BS))
+        return false;
+
+    INT32 *samples = (INT32 *)block_.data();
+    for (size_t i = 2, n = 2 * (size_t)frames; i < n; ++i)
+        samples[i] = (INT32)((UINT32)samples[i] + (UINT32)samples[i - 2]);
+
+    block_index_ = index;
+    return true;
+}
+
+} // namespace pcm_cache
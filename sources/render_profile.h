@@ -0,0 +1,73 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+#include <string>
+#include <cstdio>
+#include <cstdint>
+
+// Cost of rendering, as a histogram of the time per frame of render calls,
+// in power-of-two buckets of nanoseconds.
+struct render_profile {
+    static constexpr unsigned bucket_count = 32;
+
+    std::uint64_t tracks = 0;
+    std::uint64_t calls = 0;
+    std::uint64_t frames = 0;
+    double seconds = 0;
+    std::uint64_t buckets[bucket_count] = {};
+
+    void add(double secs, std::uint32_t count);
+    void merge(const render_profile &other);
+    void append_json(std::string &json) const;
+};
+
+inline void render_profile::add(double secs, std::uint32_t count)
+{
+    if (count == 0)
+        return;
+
+    double ns = 1e9 * secs / count;
+    unsigned bucket = 0;
+    while (bucket + 1 < bucket_count && ns >= (double)(2u << bucket))
+        ++bucket;
+
+    ++calls;
+    frames += count;
+    seconds += secs;
+    ++buckets[bucket];
+}
+
+inline void render_profile::merge(const render_profile &other)
+{
+    tracks += other.tracks;
+    calls += other.calls;
+    frames += other.frames;
+    seconds += other.seconds;
+    for (unsigned i = 0; i < bucket_count; ++i)
+        buckets[i] += other.buckets[i];
+}
+
+inline void render_profile::append_json(std::string &json) const
+{
+    char item[128];
+    sprintf(item, "{\"tracks\":%llu,\"calls\":%llu,\"frames\":%llu,\"seconds\":%.6f,\"ns_per_frame\":{",
+            (unsigned long long)tracks, (unsigned long long)calls,
+            (unsigned long long)frames, seconds);
+    json.append(item);
+
+    bool first = true;
+    for (unsigned i = 0; i < bucket_count; ++i) {
+        if (buckets[i] == 0)
+            continue;
+        // keyed by the lower bound of the bucket
+        sprintf(item, "%s\"%lu\":%llu", first ? "" : ",",
+                i ? (1ul << i) : 0ul, (unsigned long long)buckets[i]);
+        json.append(item);
+        first = false;
+    }
+
+    json.append("}}");
+}
@@ -0,0 +1,198 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Soak test: loads the plugin like the host does, and plays the given files
+// on several threads at once, with random reads and seeks, while another
+// thread changes the options. Every second it reports the resident memory of
+// the process, which must level off, and the throughput of rendering.
+//
+// usage: cmus-vgm-soak <plugin> <seconds> <threads> <file>...
+
+extern "C" {
+#include <ip.h>
+#include <comment.h>
+}
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static constexpr unsigned samplerate = 44100;
+
+static const input_plugin_ops *ops;
+static const input_plugin_opt *options;
+
+static std::vector<std::string> files;
+static std::atomic<bool> running {true};
+static std::atomic<std::uint64_t> frames_rendered {0};
+static std::atomic<std::uint64_t> opens {0};
+static std::atomic<std::uint64_t> failures {0};
+
+static bool set_option(const char *name, const char *value)
+{
+    for (const input_plugin_opt *opt = options; opt->name; ++opt) {
+        if (!strcmp(opt->name, name))
+            return opt->set(value) == 0;
+    }
+    return false;
+}
+
+static std::string get_option(const char *name)
+{
+    std::string value;
+    for (const input_plugin_opt *opt = options; opt->name; ++opt) {
+        char *str = nullptr;
+        if (!strcmp(opt->name, name) && opt->get(&str) == 0) {
+            value = str;
+            free(str);
+        }
+    }
+    return value;
+}
+
+// plays a file partly, as a listener skipping around would
+static void play_file(const std::string &path, std::minstd_rand &random)
+{
+    input_plugin_data ip_data;
+    memset(&ip_data, 0, sizeof(ip_data));
+    std::string filename = path;
+    ip_data.filename = &filename[0];
+    ip_data.fd = open(path.c_str(), O_RDONLY);
+    if (ip_data.fd == -1) {
+        ++failures;
+        return;
+    }
+
+    if (ops->open(&ip_data) != 0)
+        ++failures;
+    else {
+        ++opens;
+        if (random() % 4 == 0) {
+            struct keyval *comments = nullptr;
+            if (ops->read_comments(&ip_data, &comments) == 0)
+                keyvals_free(comments);
+        }
+
+        int framesize = sf_get_frame_size(ip_data.sf);
+        double duration = ops->duration(&ip_data);
+        std::vector<char> buffer(4096 * framesize);
+        unsigned steps = 1 + random() % 64;
+        for (unsigned i = 0; i < steps && running; ++i) {
+            if (random() % 8 == 0) {
+                double offset = duration * (random() % 1000) / 900.0; // past the end too
+                if (ops->seek(&ip_data, offset) != 0) {
+                    ++failures;
+                    break;
+                }
+            }
+            int count = ops->read(&ip_data, buffer.data(), 1 + random() % buffer.size());
+            if (count < 0) {
+                ++failures;
+                break;
+            }
+            frames_rendered += count / framesize;
+        }
+        ops->close(&ip_data);
+    }
+
+    close(ip_data.fd);
+}
+
+static void player_thread(unsigned index)
+{
+    std::minstd_rand random(index + 1);
+    while (running)
+        play_file(files[random() % files.size()], random);
+}
+
+static void options_thread()
+{
+    std::minstd_rand random(0);
+    const char *const bools[] = {"false", "true"};
+    const char *const loops[] = {"1", "2", "3"};
+    while (running) {
+        set_option("loop_cache", bools[random() % 2]);
+        set_option("prewarm", bools[random() % 2]);
+        set_option("stems", bools[random() % 2]);
+        set_option("max_loops", loops[random() % 3]);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+static double resident_mib()
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return -1;
+    unsigned long size = 0, resident = 0;
+    bool ok = fscanf(file, "%lu %lu", &size, &resident) == 2;
+    fclose(file);
+    return ok ? (double)resident * sysconf(_SC_PAGESIZE) / (1 << 20) : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5) {
+        fprintf(stderr, "usage: %s <plugin> <seconds> <threads> <file>...\n", argv[0]);
+        return 1;
+    }
+
+    void *plugin = dlopen(argv[1], RTLD_NOW | RTLD_LOCAL);
+    if (!plugin) {
+        fprintf(stderr, "cannot load the plugin: %s\n", dlerror());
+        return 1;
+    }
+    ops = (const input_plugin_ops *)dlsym(plugin, "ip_ops");
+    options = (const input_plugin_opt *)dlsym(plugin, "ip_options");
+    if (!ops || !options) {
+        fprintf(stderr, "not an input plugin: %s\n", argv[1]);
+        return 1;
+    }
+
+    unsigned seconds = strtoul(argv[2], nullptr, 10);
+    unsigned count = strtoul(argv[3], nullptr, 10);
+    files.assign(argv + 4, argv + argc);
+    if (count < 1)
+        count = 1;
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < count; ++i)
+        threads.emplace_back(&player_thread, i);
+    threads.emplace_back(&options_thread);
+
+    std::uint64_t last_frames = 0, last_opens = 0;
+    double peak = 0;
+    for (unsigned t = 1; t <= seconds; ++t) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::uint64_t now_frames = frames_rendered, now_opens = opens;
+        double rss = resident_mib();
+        peak = std::max(peak, rss);
+        printf("%4u s: rss %.1f MiB, %.1fx real time, %llu opens/s, %llu failures\n",
+               t, rss, (double)(now_frames - last_frames) / samplerate,
+               (unsigned long long)(now_opens - last_opens), (unsigned long long)failures.load());
+        fflush(stdout);
+        last_frames = now_frames;
+        last_opens = now_opens;
+    }
+
+    running = false;
+    for (std::thread &thread : threads)
+        thread.join();
+
+    printf("peak rss %.1f MiB, %llu opens, %llu failures\n",
+           peak, (unsigned long long)opens.load(), (unsigned long long)failures.load());
+    printf("stats: %s\n", get_option("stats").c_str());
+    return 0;
+}
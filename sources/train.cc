@@ -0,0 +1,549 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Training workload for profile-guided builds, which doubles as a benchmark.
+// It writes a small synthetic corpus of VGM, VGZ, S98 and DRO files, loads
+// the plugin like the host does, plays each file through `ip_ops`, and
+// reports the speed of rendering relative to real time. Given a baseline
+// build of the plugin, it plays the corpus through both and reports the
+// speedup of the first over the baseline.
+//
+// usage: cmus-vgm-train <plugin> <directory> [<baseline plugin>]
+
+extern "C" {
+#include <ip.h>
+#include <comment.h>
+}
+#include <zlib.h>
+#include <functional>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//------------------------------------------------------------------------------
+// Synthetic music: random notes of a pentatonic scale on three voices of each
+// chip, changing every eighth of a second.
+
+typedef std::function<void(unsigned port, unsigned reg, unsigned val)> reg_writer;
+
+struct sequencer {
+    std::uint32_t seed = 12345;
+
+    int next_note()
+    {
+        static const int scale[] = {0, 2, 4, 7, 9};
+        seed = seed * 1103515245 + 12345;
+        unsigned r = seed >> 16;
+        return 48 + 12 * (r % 3) + scale[(r / 3) % 5];
+    }
+};
+
+static double note_frequency(int note)
+{
+    return 440.0 * std::pow(2.0, (note - 69) / 12.0);
+}
+
+// F-number and block of a frequency, for a chip whose F-number has `bits` bits
+static unsigned fm_fnum(double freq, double rate, int shift, unsigned bits, unsigned &block)
+{
+    double fnum = 0;
+    for (block = 0; block < 8; ++block) {
+        fnum = freq * std::ldexp(1.0, shift - (int)block) / rate;
+        if (fnum < (1u << bits))
+            return (unsigned)std::lround(fnum);
+    }
+    block = 7;
+    return (1u << bits) - 1;
+}
+
+// YM2612, and the FM part of YM2608
+static void opn_init(const reg_writer &w)
+{
+    w(0, 0x22, 0x00);
+    w(0, 0x27, 0x00);
+    w(0, 0x2B, 0x00);
+    for (unsigned ch = 0; ch < 3; ++ch) {
+        w(0, 0xB0 + ch, 0x04);
+        w(0, 0xB4 + ch, 0xC0);
+        for (unsigned slot = 0; slot < 16; slot += 4) {
+            w(0, 0x30 + slot + ch, 0x01);
+            w(0, 0x40 + slot + ch, 0x18);
+            w(0, 0x50 + slot + ch, 0x1F);
+            w(0, 0x60 + slot + ch, 0x08);
+            w(0, 0x70 + slot + ch, 0x04);
+            w(0, 0x80 + slot + ch, 0x47);
+            w(0, 0x90 + slot + ch, 0x00);
+        }
+    }
+}
+
+static void opn_note(const reg_writer &w, unsigned clock, unsigned ch, int note)
+{
+    unsigned block;
+    unsigned fnum = fm_fnum(note_frequency(note), clock / 144.0, 21, 11, block);
+    w(0, 0x28, ch);
+    w(0, 0xA4 + ch, (block << 3) | (fnum >> 8));
+    w(0, 0xA0 + ch, fnum & 0xFF);
+    w(0, 0x28, 0xF0 | ch);
+}
+
+// YM2151
+static void opm_init(const reg_writer &w)
+{
+    for (unsigned ch = 0; ch < 3; ++ch) {
+        w(0, 0x20 + ch, 0xC4);
+        w(0, 0x30 + ch, 0x00);
+        for (unsigned op = 0; op < 32; op += 8) {
+            w(0, 0x40 + op + ch, 0x01);
+            w(0, 0x60 + op + ch, 0x18);
+            w(0, 0x80 + op + ch, 0x1F);
+            w(0, 0xA0 + op + ch, 0x08);
+            w(0, 0xC0 + op + ch, 0x04);
+            w(0, 0xE0 + op + ch, 0x47);
+        }
+    }
+}
+
+static void opm_note(const reg_writer &w, unsigned ch, int note)
+{
+    static const unsigned codes[] = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14};
+    int k = std::max(note - 13, 0); // from C#0
+    unsigned octave = std::min(k / 12, 7);
+    w(0, 0x08, ch);
+    w(0, 0x28 + ch, (octave << 4) | codes[k % 12]);
+    w(0, 0x08, 0x78 | ch);
+}
+
+// YM3812
+static void opl_init(const reg_writer &w)
+{
+    static const unsigned modulators[] = {0x00, 0x01, 0x02};
+    w(0, 0x01, 0x20);
+    for (unsigned ch = 0; ch < 3; ++ch) {
+        for (unsigned op : {modulators[ch], modulators[ch] + 3}) {
+            w(0, 0x20 + op, 0x01);
+            w(0, 0x60 + op, 0xF4);
+            w(0, 0x80 + op, 0x56);
+            w(0, 0xE0 + op, 0x00);
+        }
+        w(0, 0x40 + modulators[ch], 0x10);
+        w(0, 0x43 + modulators[ch], 0x00);
+        w(0, 0xC0 + ch, 0x01);
+    }
+}
+
+static void opl_note(const reg_writer &w, unsigned clock, unsigned ch, int note)
+{
+    unsigned block;
+    unsigned fnum = fm_fnum(note_frequency(note), clock / 72.0, 20, 10, block);
+    w(0, 0xB0 + ch, 0x00);
+    w(0, 0xA0 + ch, fnum & 0xFF);
+    w(0, 0xB0 + ch, 0x20 | (block << 2) | (fnum >> 8));
+}
+
+// SN76489, which takes bytes instead of register writes
+static void dcsg_note(std::vector<std::uint8_t> &out, unsigned clock, unsigned ch, int note)
+{
+    unsigned n = std::min<unsigned>(std::lround(clock / (32 * note_frequency(note))), 1023);
+    out.insert(out.end(), {0x50, (std::uint8_t)(0x80 | (ch << 5) | (n & 0x0F))});
+    out.insert(out.end(), {0x50, (std::uint8_t)((n >> 4) & 0x3F)});
+    out.insert(out.end(), {0x50, (std::uint8_t)(0x90 | (ch << 5) | 0x02)});
+}
+
+// SSG part of YM2608
+static void ssg_note(const reg_writer &w, unsigned clock, int note)
+{
+    unsigned period = std::min<unsigned>(std::lround(clock / (64 * note_frequency(note))), 4095);
+    w(0, 0x00, period & 0xFF);
+    w(0, 0x01, period >> 8);
+}
+
+//------------------------------------------------------------------------------
+static void put16(std::vector<std::uint8_t> &data, size_t offset, unsigned value)
+{
+    data[offset] = value & 0xFF;
+    data[offset + 1] = (value >> 8) & 0xFF;
+}
+
+static void put32(std::vector<std::uint8_t> &data, size_t offset, std::uint32_t value)
+{
+    put16(data, offset, value & 0xFFFF);
+    put16(data, offset + 2, value >> 16);
+}
+
+static constexpr unsigned samplerate = 44100;
+static constexpr unsigned stepms = 125;
+static constexpr unsigned songsteps = 160; // 20 seconds
+static constexpr unsigned loopstep = 80; // loop over the last 10 seconds
+
+static std::vector<std::uint8_t> make_vgm()
+{
+    const unsigned snclock = 3579545, opn2clock = 7670453, opmclock = 3579545, oplclock = 3579545;
+
+    std::vector<std::uint8_t> data(0x100);
+    memcpy(&data[0], "Vgm ", 4);
+    put32(data, 0x08, 0x151);
+    put32(data, 0x0C, snclock);
+    put16(data, 0x28, 0x0009);
+    data[0x2A] = 16;
+    put32(data, 0x2C, opn2clock);
+    put32(data, 0x30, opmclock);
+    put32(data, 0x34, 0x100 - 0x34);
+    put32(data, 0x50, oplclock);
+
+    auto writer = [&data](std::uint8_t cmd) -> reg_writer {
+        return [&data, cmd](unsigned, unsigned reg, unsigned val) {
+            data.insert(data.end(), {cmd, (std::uint8_t)reg, (std::uint8_t)val});
+        };
+    };
+    reg_writer opn2 = writer(0x52), opm = writer(0x54), opl = writer(0x5A);
+
+    opn_init(opn2);
+    opm_init(opm);
+    opl_init(opl);
+    for (std::uint8_t mute : {0x9F, 0xBF, 0xDF, 0xFF})
+        data.insert(data.end(), {0x50, mute});
+
+    sequencer seq;
+    size_t loopoffset = 0;
+    unsigned stepsamples = samplerate * stepms / 1000;
+    for (unsigned step = 0; step < songsteps; ++step) {
+        if (step == loopstep)
+            loopoffset = data.size();
+        for (unsigned ch = 0; ch < 3; ++ch) {
+            opn_note(opn2, opn2clock, ch, seq.next_note());
+            opm_note(opm, ch, seq.next_note());
+            opl_note(opl, oplclock, ch, seq.next_note());
+            dcsg_note(data, snclock, ch, seq.next_note());
+        }
+        data.insert(data.end(), {0x61, (std::uint8_t)(stepsamples & 0xFF), (std::uint8_t)(stepsamples >> 8)});
+    }
+    data.push_back(0x66);
+
+    put32(data, 0x04, data.size() - 0x04);
+    put32(data, 0x18, songsteps * stepsamples);
+    put32(data, 0x1C, loopoffset - 0x1C);
+    put32(data, 0x20, (songsteps - loopstep) * stepsamples);
+    return data;
+}
+
+static void s98_wait(std::vector<std::uint8_t> &data, unsigned syncs)
+{
+    if (syncs == 1) {
+        data.push_back(0xFF);
+        return;
+    }
+    data.push_back(0xFE);
+    for (unsigned n = syncs - 2; ; n >>= 7) {
+        data.push_back((n & 0x7F) | ((n > 0x7F) ? 0x80 : 0x00));
+        if (n <= 0x7F)
+            break;
+    }
+}
+
+static std::vector<std::uint8_t> make_s98()
+{
+    const unsigned opnaclock = 7987200;
+
+    std::vector<std::uint8_t> data(0x30);
+    memcpy(&data[0], "S983", 4);
+    put32(data, 0x04, 1); // syncs of 1 ms
+    put32(data, 0x08, 1000);
+    put32(data, 0x14, 0x30);
+    put32(data, 0x1C, 1);
+    put32(data, 0x20, 4); // YM2608
+    put32(data, 0x24, opnaclock);
+
+    reg_writer opna = [&data](unsigned port, unsigned reg, unsigned val) {
+        data.insert(data.end(), {(std::uint8_t)port, (std::uint8_t)reg, (std::uint8_t)val});
+    };
+
+    opna(0, 0x29, 0x80);
+    opn_init(opna);
+    opna(0, 0x07, 0x3E);
+    opna(0, 0x08, 0x0C);
+
+    sequencer seq;
+    size_t loopoffset = 0;
+    for (unsigned step = 0; step < songsteps; ++step) {
+        if (step == loopstep)
+            loopoffset = data.size();
+        for (unsigned ch = 0; ch < 3; ++ch)
+            opn_note(opna, opnaclock, ch, seq.next_note());
+        ssg_note(opna, opnaclock, seq.next_note());
+        s98_wait(data, stepms);
+    }
+    data.push_back(0xFD);
+
+    put32(data, 0x18, loopoffset);
+    return data;
+}
+
+static std::vector<std::uint8_t> make_dro()
+{
+    const unsigned oplclock = 3579545;
+
+    std::vector<unsigned> codemap;
+    std::vector<std::uint8_t> pairs;
+    reg_writer opl = [&codemap, &pairs](unsigned, unsigned reg, unsigned val) {
+        unsigned code = std::find(codemap.begin(), codemap.end(), reg) - codemap.begin();
+        if (code == codemap.size())
+            codemap.push_back(reg);
+        pairs.insert(pairs.end(), {(std::uint8_t)code, (std::uint8_t)val});
+    };
+
+    opl_init(opl);
+    sequencer seq;
+    for (unsigned step = 0; step < songsteps; ++step) {
+        for (unsigned ch = 0; ch < 3; ++ch)
+            opl_note(opl, oplclock, ch, seq.next_note());
+        pairs.insert(pairs.end(), {0xFF, (std::uint8_t)(stepms - 1)});
+    }
+
+    // the delay takes the first code after the map, substitute it
+
+    std::uint8_t shortdelay = codemap.size();
+    for (size_t i = 0; i < pairs.size(); i += 2) {
+        if (pairs[i] == 0xFF)
+            pairs[i] = shortdelay;
+    }
+
+    std::vector<std::uint8_t> data(0x1A + codemap.size());
+    memcpy(&data[0], "DBRAWOPL", 8);
+    put16(data, 0x08, 2);
+    put16(data, 0x0A, 0);
+    put32(data, 0x0C, pairs.size() / 2);
+    put32(data, 0x10, songsteps * stepms);
+    data[0x14] = 0; // OPL2
+    data[0x15] = 0;
+    data[0x16] = 0;
+    data[0x17] = shortdelay;
+    data[0x18] = shortdelay + 1;
+    data[0x19] = codemap.size();
+    for (size_t i = 0; i < codemap.size(); ++i)
+        data[0x1A + i] = codemap[i];
+    data.insert(data.end(), pairs.begin(), pairs.end());
+    return data;
+}
+
+static std::vector<std::uint8_t> gzip(const std::vector<std::uint8_t> &data)
+{
+    z_stream stream {};
+    if (deflateInit2(&stream, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return {};
+    std::vector<std::uint8_t> out(deflateBound(&stream, data.size()));
+    stream.next_in = (Bytef *)data.data();
+    stream.avail_in = data.size();
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+    int err = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return (err == Z_STREAM_END) ? out : std::vector<std::uint8_t>();
+}
+
+static bool write_file(const std::string &path, const std::vector<std::uint8_t> &data)
+{
+    FILE *fh = fopen(path.c_str(), "wb");
+    if (!fh)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), fh) == data.size();
+    return fclose(fh) == 0 && ok;
+}
+
+//------------------------------------------------------------------------------
+struct plugin {
+    const char *path = nullptr;
+    const input_plugin_ops *ops = nullptr;
+    const input_plugin_opt *options = nullptr;
+};
+
+static bool load_plugin(const char *path, plugin &p)
+{
+    // local binding keeps two builds of the plugin apart in one process
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, "cannot load the plugin: %s\n", dlerror());
+        return false;
+    }
+    p.path = path;
+    p.ops = (const input_plugin_ops *)dlsym(handle, "ip_ops");
+    p.options = (const input_plugin_opt *)dlsym(handle, "ip_options");
+    if (!p.ops || !p.options) {
+        fprintf(stderr, "not an input plugin: %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static bool set_option(const plugin &p, const char *name, const char *value)
+{
+    for (const input_plugin_opt *opt = p.options; opt->name; ++opt) {
+        if (!strcmp(opt->name, name))
+            return opt->set(value) == 0;
+    }
+    return false;
+}
+
+// times the emulation alone: one pass of the loop, which the loop cache would
+// not replay anyway, and no background opening of the next file
+static void isolate_emulation(const plugin &p)
+{
+    const char *const settings[][2] = {
+        {"max_loops", "1"},
+        {"loop_cache", "false"},
+        {"prewarm", "false"},
+    };
+    for (const auto &setting : settings) {
+        if (!set_option(p, setting[0], setting[1]))
+            fprintf(stderr, "%s: cannot set %s, timings may include it\n", p.path, setting[0]);
+    }
+}
+
+static int read_some(const plugin &p, input_plugin_data &ip_data, std::vector<char> &buffer, double seconds, double &rendered)
+{
+    int channels = sf_get_channels(ip_data.sf);
+    double frames = seconds * samplerate;
+    while (frames > 0) {
+        int count = p.ops->read(&ip_data, buffer.data(), buffer.size());
+        if (count <= 0)
+            return count;
+        int got = count / (channels * sizeof(std::int32_t));
+        frames -= got;
+        rendered += (double)got / samplerate;
+    }
+    return 1;
+}
+
+// plays the file with seeks forward and backward, and returns the seconds of
+// audio rendered, or a negative value if it fails; only the reads and seeks
+// are timed, not the loading of the file nor its tags
+static double play_file(const plugin &p, const std::string &path, double &elapsed)
+{
+    elapsed = 0;
+
+    input_plugin_data ip_data;
+    memset(&ip_data, 0, sizeof(ip_data));
+    std::string filename = path;
+    ip_data.filename = &filename[0];
+    ip_data.fd = open(path.c_str(), O_RDONLY);
+    if (ip_data.fd == -1)
+        return -1;
+
+    typedef std::chrono::steady_clock clock;
+
+    double rendered = -1;
+    if (p.ops->open(&ip_data) == 0) {
+        struct keyval *comments = nullptr;
+        if (p.ops->read_comments(&ip_data, &comments) == 0)
+            keyvals_free(comments);
+
+        double duration = p.ops->duration(&ip_data);
+        std::vector<char> buffer(16384);
+        rendered = 0;
+
+        clock::time_point start = clock::now();
+        if (read_some(p, ip_data, buffer, duration / 4, rendered) < 0 ||
+            p.ops->seek(&ip_data, 3 * duration / 4) != 0 ||
+            p.ops->seek(&ip_data, duration / 2) != 0 ||
+            read_some(p, ip_data, buffer, duration, rendered) < 0)
+            rendered = -1;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+        p.ops->close(&ip_data);
+    }
+
+    close(ip_data.fd);
+    return rendered;
+}
+
+static constexpr unsigned rounds = 3;
+
+// plays each file a few times and keeps the fastest, returning the total
+// elapsed time, or a negative value if a file fails
+static double play_corpus(const plugin &p, const std::vector<std::string> &paths)
+{
+    double total_rendered = 0, total_elapsed = 0;
+    for (const std::string &path : paths) {
+        double best = HUGE_VAL, rendered = 0;
+        for (unsigned round = 0; round < rounds; ++round) {
+            double elapsed;
+            rendered = play_file(p, path, elapsed);
+            if (rendered < 0) {
+                fprintf(stderr, "%s: cannot play: %s\n", p.path, path.c_str());
+                return -1;
+            }
+            best = std::min(best, elapsed);
+        }
+        printf("%s: %.1f s in %.3f s, %.1fx real time\n", path.c_str(), rendered, best, rendered / best);
+        total_rendered += rendered;
+        total_elapsed += best;
+    }
+    printf("total: %.1f s in %.3f s, %.1fx real time\n", total_rendered, total_elapsed, total_rendered / total_elapsed);
+    return total_elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: %s <plugin> <directory> [<baseline plugin>]\n", argv[0]);
+        return 1;
+    }
+
+    plugin subject, baseline;
+    if (!load_plugin(argv[1], subject) || (argc == 4 && !load_plugin(argv[3], baseline)))
+        return 1;
+
+    std::string dir = argv[2];
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "cannot create the directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    std::vector<std::uint8_t> vgm = make_vgm();
+    const std::pair<const char *, std::vector<std::uint8_t>> corpus[] = {
+        {"train.vgm", vgm},
+        {"train.vgz", gzip(vgm)},
+        {"train.s98", make_s98()},
+        {"train.dro", make_dro()},
+    };
+
+    std::vector<std::string> paths;
+    for (const auto &file : corpus) {
+        std::string path = dir + "/" + file.first;
+        if (file.second.empty() || !write_file(path, file.second)) {
+            fprintf(stderr, "cannot write: %s\n", path.c_str());
+            return 1;
+        }
+        paths.push_back(path);
+    }
+
+    isolate_emulation(subject);
+    double elapsed = play_corpus(subject, paths);
+    if (elapsed < 0)
+        return 1;
+
+    if (baseline.ops) {
+        printf("baseline %s:\n", baseline.path);
+        isolate_emulation(baseline);
+        double baseline_elapsed = play_corpus(baseline, paths);
+        if (baseline_elapsed < 0)
+            return 1;
+        printf("speedup: %.3fx\n", baseline_elapsed / elapsed);
+    }
+
+    return 0;
+}
@@ -5,6 +5,9 @@
 
 #include "vgm.h"
 #include "mapped_file.h"
+#include "inflate_loader.h"
+#include "pcm_cache.h"
+#include "render_profile.h"
 extern "C" {
 #include <comment.h>
 #include <xmalloc.h>
@@ -14,11 +17,27 @@ extern "C" {
 #include <player/s98player.hpp>
 #include <player/droplayer.hpp>
 #include <utils/MemoryLoader.h>
+#include <emu/SoundEmu.h>
 #include <zlib.h>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <typeinfo>
 #include <cmath>
+#include <climits>
 #include <cstdio>
 #include <cstring>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 //------------------------------------------------------------------------------
 struct DATA_LOADER_delete { void operator()(DATA_LOADER *x) const noexcept { DataLoader_Deinit(x); } };
@@ -31,30 +50,239 @@ static_assert(sizeof(WAVE_32BS) == 2 * sizeof(INT32) &&
 
 static constexpr int samplerate = 44100;
 static constexpr UINT32 maxrender = 4096;
+static constexpr size_t maxfilesize = 256 << 20;
 static const double fadefactor = std::exp(-1.0 / samplerate);
-static UINT32 maxloops = 1;
+static constexpr double fadethreshold = 1e-4;
+static constexpr double prewarmlead = 10.0;
+static constexpr UINT32 loopcachemax = 120 * samplerate;
+static constexpr UINT32 minrender = 64;
+static constexpr UINT32 calibrationlength = samplerate / 4;
+
+// Options are published as immutable snapshots: a setter copies the current
+// config, modifies it and swaps the pointer atomically, and each instance
+// captures the snapshot at open, so it sees consistent values without locks.
+struct vgm_config {
+    UINT32 maxloops = 1;
+    std::string pcmcachedir;
+    UINT64 pcmcachesize = (UINT64)1024 << 20; // bytes, 0 if unbounded
+    UINT32 renderbudget = 0; // milliseconds per read, 0 if unbounded
+    bool profile = false;
+    bool stems = false;
+    UINT64 memorybudget = 0; // bytes, 0 if unbounded
+    bool loopcache = true;
+    bool prewarm = true;
+};
+
+typedef std::shared_ptr<const vgm_config> vgm_config_ptr;
+
+struct config_state {
+    vgm_config_ptr current {new vgm_config};
+    std::mutex write_mutex;
+};
+
+static config_state &config_state_instance()
+{
+    // leaked like the pools, detached prewarm workers read it until exit
+    static config_state &state = *new config_state;
+    return state;
+}
+
+static vgm_config_ptr vgm_config_get()
+{
+    return std::atomic_load(&config_state_instance().current);
+}
+
+template <class Fn> static void vgm_config_update(Fn &&fn)
+{
+    config_state &state = config_state_instance();
+    std::lock_guard<std::mutex> lock(state.write_mutex);
+    std::shared_ptr<vgm_config> config(new vgm_config(*vgm_config_get()));
+    fn(*config);
+    std::atomic_store(&state.current, vgm_config_ptr(std::move(config)));
+}
+
+//------------------------------------------------------------------------------
+// Players are kept in a pool after they stop, so playing an album reuses
+// them instead of allocating new ones for each track.
+
+struct player_pool {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<PlayerBase>> players;
+    UINT64 hits = 0;
+    UINT64 misses = 0;
+    static constexpr size_t max_players = 4;
+};
+
+static player_pool &player_pool_instance()
+{
+    // leaked like the prewarm pool, players may be released by its workers
+    static player_pool &pool = *new player_pool;
+    return pool;
+}
+
+template <class T> static PlayerBase *vgm_player_acquire()
+{
+    player_pool &pool = player_pool_instance();
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    for (auto it = pool.players.begin(); it != pool.players.end(); ++it) {
+        if (typeid(**it) == typeid(T)) {
+            PlayerBase *player = it->release();
+            pool.players.erase(it);
+            ++pool.hits;
+            return player;
+        }
+    }
+
+    ++pool.misses;
+    lock.unlock();
+    return new T;
+}
+
+// acquires a player for the format of the file, or null if not supported
+static PlayerBase *vgm_player_for(DATA_LOADER *loader)
+{
+    if (VGMPlayer::IsMyFile(loader) == 0)
+        return vgm_player_acquire<VGMPlayer>();
+    else if (S98Player::IsMyFile(loader) == 0)
+        return vgm_player_acquire<S98Player>();
+    else if (DROPlayer::IsMyFile(loader) == 0)
+        return vgm_player_acquire<DROPlayer>();
+    return nullptr;
+}
+
+static void vgm_player_release(std::unique_ptr<PlayerBase> player)
+{
+    player->SetCallback(nullptr, nullptr);
+
+    player_pool &pool = player_pool_instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    if (pool.players.size() < player_pool::max_players)
+        pool.players.push_back(std::move(player));
+}
+
+//------------------------------------------------------------------------------
+// Frames of the loop section, captured on the first pass and checked against
+// the second: if the two match, the chips run periodically, and the next
+// passes are served from the buffer instead of emulating them again.
+struct loop_cache {
+    enum class State { off, capture, replay };
+    State state = State::off;
+    UINT64 start = 0; // frame where the loop section starts
+    UINT64 length = 0; // frames of the loop section
+    UINT64 next = 0; // next frame expected during capture
+    std::vector<WAVE_32BS> frames;
+};
 
 struct vgm_private {
+    ~vgm_private();
+    vgm_config_ptr config;
     enum class State { stopped, started, atend };
     State state = State::stopped;
     double volume = 1;
+    UINT64 position = 0; // frames output since the start
+    UINT64 play_length = 0; // frames up to the end of the last loop
+    UINT64 length = 0; // total frames, including the fade-out
+    double frame_cost = 0; // seconds to render a frame, moving average
+    bool prewarm_requested = false; // guessed the next track
+    bool played = false; // read from at least once
+    std::vector<WAVE_32BS> preroll;
+    size_t preroll_pos = 0;
+    loop_cache loop;
+    bool pcm_opened = false; // looked up in the cache, on the first read
+    bool pcm_complete = false; // the writer holds a full play, stored on close
+    std::string pcm_path;
+    std::unique_ptr<pcm_cache::reader> pcm_reader;
+    std::unique_ptr<pcm_cache::writer> pcm_writer;
+    std::unique_ptr<render_profile> profile;
     mapped_file map;
     DATA_LOADER_u loader;
+    bool loader_mapped = false; // the loader buffer is the mapping
     std::unique_ptr<PlayerBase> player;
+    // in stems mode, `player` plays the first chip, and these play the others
+    std::vector<std::unique_ptr<PlayerBase>> stems;
+    std::vector<WAVE_32BS> stem_buffer;
+    size_t memory = 0; // bytes accounted to this instance
 };
 
+static void vgm_stems_close(vgm_private *priv);
+static void vgm_memory_release(vgm_private *priv);
+
+vgm_private::~vgm_private()
+{
+    vgm_memory_release(this);
+    vgm_stems_close(this);
+    if (player) {
+        player->Stop();
+        player->UnloadFile();
+        vgm_player_release(std::move(player));
+    }
+    if (loader_mapped)
+        loader->_data = nullptr; // not for the loader to free
+}
+
 //------------------------------------------------------------------------------
+static int vgm_open_file(input_plugin_data *ip_data);
 static int vgz_open(input_plugin_data *ip_data, const UINT8 *data, size_t size);
 static int vgm_open_after_map(input_plugin_data *ip_data);
+static int vgm_open_loader(input_plugin_data *ip_data, DATA_LOADER *loader, bool mapped = false);
 static UINT8 vgm_play_callback(PlayerBase *player, void *user_param, UINT8 evt_type, void *evt_param);
+static void vgm_compute_length(vgm_private *priv);
+static void vgm_pcm_open(vgm_private *priv);
+static void vgm_stems_open(vgm_private *priv);
+static void vgm_stems_channel_map(unsigned count, channel_position_t *map);
+static void vgm_loop_disable(loop_cache &loop);
+static bool vgm_prewarm_take(input_plugin_data *ip_data);
+static void vgm_prewarm_next(const char *filename);
+static UINT32 vgm_render(vgm_private *priv, UINT32 want, WAVE_32BS *data);
+static bool vgm_memory_fits(vgm_private *priv, UINT64 size);
+static bool vgm_memory_admit(vgm_private *priv);
+static void vgm_memory_enforce(vgm_private *priv);
+static bool vgm_memory_available();
 
 //------------------------------------------------------------------------------
+// Files are untrusted, and the host is C: runs a call of the host, and turns
+// any exception into an error code rather than let it reach the host.
+template <class F>
+static int vgm_guard(const char *function, input_plugin_data *ip_data, const F &call)
+{
+    try {
+        return call();
+    }
+    catch (std::bad_alloc &) {
+        errno = ENOMEM;
+        return -IP_ERROR_ERRNO;
+    }
+    catch (std::exception &ex) {
+        d_print("%s(%p): %s\n", function, ip_data, ex.what());
+        return -IP_ERROR_INTERNAL;
+    }
+}
+
 static int vgm_open(input_plugin_data *ip_data)
 {
     d_print("vgm_open(%p): %s\n", ip_data, ip_data->filename);
 
+    if (vgm_prewarm_take(ip_data)) {
+        d_print("vgm_open(%p): using prewarmed player\n", ip_data);
+        return 0;
+    }
+
+    int ret = vgm_guard("vgm_open", ip_data, [ip_data]() { return vgm_open_file(ip_data); });
+    if (ret != 0)
+        ip_data->priv = nullptr;
+
+    return ret;
+}
+
+static int vgm_open_file(input_plugin_data *ip_data)
+{
     int ret = 0;
     std::unique_ptr<vgm_private> priv(new vgm_private);
+    priv->config = vgm_config_get();
+    if (priv->config->profile)
+        priv->profile.reset(new render_profile);
 
     ip_data->priv = priv.get();
 
@@ -71,6 +299,11 @@ static int vgm_open(input_plugin_data *ip_data)
             ret = vgm_open_after_map(ip_data);
     }
 
+    if (ret == 0 && !vgm_memory_admit(priv.get())) {
+        errno = ENOMEM;
+        ret = -IP_ERROR_ERRNO;
+    }
+
     if (ret == 0)
         priv.release();
     else
@@ -81,42 +314,23 @@ static int vgm_open(input_plugin_data *ip_data)
 
 static int vgz_open(input_plugin_data *ip_data, const UINT8 *data, size_t size)
 {
-    vgm_private *priv = (vgm_private *)ip_data->priv;
-
-    struct File_Deleter { void operator()(FILE *x) { fclose(x); } };
-    std::unique_ptr<FILE, File_Deleter> fh(tmpfile());
-    if (!fh)
-        return -IP_ERROR_ERRNO;
-
-    int fd = dup(ip_data->fd);
-    if (fd == -1)
-        return -IP_ERROR_ERRNO;
-
-    struct Gz_Deleter { void operator()(gzFile x) { gzclose(x); } };
-    std::unique_ptr<gzFile_s, Gz_Deleter> gz(gzdopen(fd, "r"));
-    if (!gz) {
-        close(fd);
-        return -IP_ERROR_FILE_FORMAT;
-    }
-
-    int gzcount;
-    UINT8 buffer[8192];
-    while ((gzcount = gzread(gz.get(), buffer, sizeof(buffer))) > 0) {
-        if (fwrite(buffer, 1, gzcount, fh.get()) != gzcount)
-            return -IP_ERROR_ERRNO;
-    }
-    if (gzcount == -1)
+    // measured first, so the loader is given the exact size to allocate,
+    // and a file which does not fit is refused without holding its data
+    UINT32 length;
+    if (!gzip_inflated_size(data, size, maxfilesize, length))
         return -IP_ERROR_FILE_FORMAT;
 
-    if (fflush(fh.get()) != 0)
+    vgm_private *priv = (vgm_private *)ip_data->priv;
+    if (!vgm_memory_fits(priv, (UINT64)length + inflate_state_size)) {
+        errno = ENOMEM;
         return -IP_ERROR_ERRNO;
-    rewind(fh.get());
+    }
 
-    mapped_file &map = priv->map;
-    if (!map.open(fileno(fh.get())))
-        return -IP_ERROR_ERRNO;
+    DATA_LOADER *loader = InflateLoader_Init(data, size, length, 15 + 16);
+    if (!loader)
+        throw std::bad_alloc();
 
-    return vgm_open_after_map(ip_data);
+    return vgm_open_loader(ip_data, loader);
 }
 
 static int vgm_open_after_map(input_plugin_data *ip_data)
@@ -126,23 +340,50 @@ static int vgm_open_after_map(input_plugin_data *ip_data)
     mapped_file &map = priv->map;
     const UINT8 *data = (const UINT8 *)map.data();
     size_t size = map.size();
+    if (size > maxfilesize)
+        return -IP_ERROR_FILE_FORMAT;
 
     DATA_LOADER *loader = MemoryLoader_Init(data, size);
     if (!loader)
         throw std::bad_alloc();
+
+    return vgm_open_loader(ip_data, loader, true);
+}
+
+// Makes the loader use the mapping as its buffer, after it has preloaded the
+// header, instead of copying the whole file, so the copy of the file held by
+// the loader is only page cache. libvgm has no call to give a loader an outside
+// buffer, so this sets the fields of DATA_LOADER, as laid out in the libvgm
+// submodule. The players still copy data blocks into their own memory, such as
+// PCM banks and sample ROMs. The mapping is read-only, a write into it faults.
+static void vgm_loader_use_mapping(vgm_private *priv)
+{
+    DATA_LOADER *loader = priv->loader.get();
+    mapped_file &map = priv->map;
+    if (DataLoader_GetTotalSize(loader) != map.size() || !loader->_data)
+        return;
+
+    free(loader->_data);
+    loader->_data = (UINT8 *)map.data();
+    loader->_bytesLoaded = loader->_bytesTotal;
+    loader->_status = DLSTAT_LOADED;
+    priv->loader_mapped = true;
+}
+
+static int vgm_open_loader(input_plugin_data *ip_data, DATA_LOADER *loader, bool mapped)
+{
+    vgm_private *priv = (vgm_private *)ip_data->priv;
+
     priv->loader.reset(loader);
 
     DataLoader_SetPreloadBytes(loader, 0x100);
     if (DataLoader_Load(loader) != 0)
         return -IP_ERROR_FILE_FORMAT;
+    if (mapped)
+        vgm_loader_use_mapping(priv);
 
-    if (VGMPlayer::IsMyFile(loader) == 0)
-        priv->player.reset(new VGMPlayer);
-    else if (S98Player::IsMyFile(loader) == 0)
-        priv->player.reset(new S98Player);
-    else if (DROPlayer::IsMyFile(loader) == 0)
-        priv->player.reset(new DROPlayer);
-    else
+    priv->player.reset(vgm_player_for(loader));
+    if (!priv->player)
         return -IP_ERROR_FILE_FORMAT;
 
     PlayerBase &player = *priv->player;
@@ -150,27 +391,257 @@ static int vgm_open_after_map(input_plugin_data *ip_data)
         return -IP_ERROR_FILE_FORMAT;
     player.SetCallback(&vgm_play_callback, priv);
     player.SetSampleRate(samplerate);
+    vgm_compute_length(priv);
+    if (priv->config->stems)
+        vgm_stems_open(priv);
     player.Start();
     priv->state = vgm_private::State::started;
     priv->volume = 1;
 
-    ip_data->sf = sf_bits(32) | sf_rate(samplerate) | sf_channels(2) | sf_signed(1);
+    unsigned channels = 2 * (1 + priv->stems.size());
+    ip_data->sf = sf_bits(32) | sf_rate(samplerate) | sf_channels(channels) | sf_signed(1);
     ip_data->sf |= sf_host_endian();
-    channel_map_init_stereo(ip_data->channel_map);
+    if (priv->stems.empty())
+        channel_map_init_stereo(ip_data->channel_map);
+    else
+        vgm_stems_channel_map(channels / 2, ip_data->channel_map);
     return 0;
 }
 
+//------------------------------------------------------------------------------
+// Stems: each chip is output as a separate stereo pair. Every pair has its own
+// player, which has all chips disabled except its own, so each chip is
+// emulated once. If there are more chips than pairs, the last pair has all the
+// remaining chips.
+
+static void vgm_stems_mute(PlayerBase &player, unsigned stem, unsigned count)
+{
+    std::vector<PLR_DEV_INFO> devices;
+    player.GetSongDeviceInfo(devices);
+
+    for (unsigned i = 0; i < devices.size(); ++i) {
+        bool enabled = i == stem || (stem + 1 == count && i > stem);
+        PLR_MUTE_OPTS mute {};
+        mute.disable = enabled ? 0x00 : 0xFF;
+        player.SetDeviceMuting(devices[i].id, mute);
+    }
+}
+
+static void vgm_stems_unmute(PlayerBase &player)
+{
+    // the options persist in the player, clear them before it returns to the pool
+    std::vector<PLR_DEV_INFO> devices;
+    player.GetSongDeviceInfo(devices);
+
+    for (const PLR_DEV_INFO &dev : devices) {
+        PLR_MUTE_OPTS mute {};
+        player.SetDeviceMuting(dev.id, mute);
+    }
+}
+
+static void vgm_stems_open(vgm_private *priv)
+{
+    PlayerBase &player = *priv->player;
+    DATA_LOADER *loader = priv->loader.get();
+
+    std::vector<PLR_DEV_INFO> devices;
+    player.GetSongDeviceInfo(devices);
+    unsigned count = std::min<size_t>(devices.size(), CHANNELS_MAX / 2);
+    if (count < 2)
+        return;
+
+    for (unsigned stem = 1; stem < count; ++stem) {
+        std::unique_ptr<PlayerBase> other(vgm_player_for(loader));
+        if (other && other->LoadFile(loader) == 0) {
+            priv->stems.push_back(std::move(other));
+            continue;
+        }
+        if (other)
+            vgm_player_release(std::move(other));
+        vgm_stems_close(priv);
+        return;
+    }
+
+    // the caches hold stereo renderings
+    vgm_loop_disable(priv->loop);
+
+    vgm_stems_mute(player, 0, count);
+    for (unsigned stem = 1; stem < count; ++stem) {
+        PlayerBase &other = *priv->stems[stem - 1];
+        other.SetSampleRate(samplerate);
+        vgm_stems_mute(other, stem, count);
+        other.Start();
+    }
+    priv->stem_buffer.resize(maxrender);
+}
+
+static void vgm_stems_close(vgm_private *priv)
+{
+    if (priv->stems.empty())
+        return;
+
+    if (priv->player)
+        vgm_stems_unmute(*priv->player);
+    for (std::unique_ptr<PlayerBase> &other : priv->stems) {
+        other->Stop();
+        vgm_stems_unmute(*other);
+        other->UnloadFile();
+        vgm_player_release(std::move(other));
+    }
+    priv->stems.clear();
+}
+
+static void vgm_stems_channel_map(unsigned count, channel_position_t *map)
+{
+    static const channel_position_t pairs[][2] = {
+        {CHANNEL_POSITION_FRONT_LEFT, CHANNEL_POSITION_FRONT_RIGHT},
+        {CHANNEL_POSITION_REAR_LEFT, CHANNEL_POSITION_REAR_RIGHT},
+        {CHANNEL_POSITION_SIDE_LEFT, CHANNEL_POSITION_SIDE_RIGHT},
+        {CHANNEL_POSITION_FRONT_LEFT_OF_CENTER, CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER},
+        {CHANNEL_POSITION_TOP_FRONT_LEFT, CHANNEL_POSITION_TOP_FRONT_RIGHT},
+        {CHANNEL_POSITION_TOP_REAR_LEFT, CHANNEL_POSITION_TOP_REAR_RIGHT},
+    };
+
+    if (count > sizeof(pairs) / sizeof(pairs[0])) {
+        map[0] = CHANNEL_POSITION_INVALID; // no positions for this many
+        return;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        map[2 * i] = pairs[i][0];
+        map[2 * i + 1] = pairs[i][1];
+    }
+}
+
+// renders the chips of each stem into its pair of channels; a stem which
+// ends before the others is silent for the rest
+static UINT32 vgm_stems_render_chunk(vgm_private *priv, UINT32 want, INT32 *data)
+{
+    unsigned count = 1 + priv->stems.size();
+    WAVE_32BS *buffer = priv->stem_buffer.data();
+
+    UINT32 got = 0;
+    for (unsigned stem = 0; stem < count; ++stem) {
+        PlayerBase &player = stem ? *priv->stems[stem - 1] : *priv->player;
+        std::fill(buffer, buffer + want, WAVE_32BS());
+        UINT32 n = player.Render(want, buffer);
+        got = std::max(got, n);
+        for (UINT32 i = 0; i < want; ++i) {
+            data[2 * (i * count + stem)] = (i < n) ? buffer[i].L : 0;
+            data[2 * (i * count + stem) + 1] = (i < n) ? buffer[i].R : 0;
+        }
+    }
+    return got;
+}
+
+//------------------------------------------------------------------------------
+static UINT32 vgm_fade_length()
+{
+    // count the frames `vgm_read` outputs before the volume falls under threshold
+    UINT32 count = 0;
+    for (double vol = fadefactor; vol >= fadethreshold; vol *= fadefactor)
+        ++count;
+    return count;
+}
+
+static void vgm_compute_length(vgm_private *priv)
+{
+    static const UINT32 fadelength = vgm_fade_length();
+
+    PlayerBase &player = *priv->player;
+    UINT32 loops = std::max<UINT32>(priv->config->maxloops, 1);
+    UINT32 loopticks = player.GetLoopTicks();
+
+    UINT64 length = player.Tick2Sample(player.GetTotalTicks());
+    if (loopticks > 0)
+        length += (UINT64)(loops - 1) * player.Tick2Sample(loopticks);
+    priv->play_length = length;
+
+    if (loopticks > 0) // if a looped song, it will smoothly turn down the volume
+        length += fadelength;
+    priv->length = length;
+
+    loop_cache &loop = priv->loop;
+    loop.length = player.Tick2Sample(loopticks);
+    loop.start = player.Tick2Sample(player.GetTotalTicks()) - loop.length;
+    loop.next = loop.start;
+    // worth it only if it plays more than the two passes needed to check it
+    bool cacheable = priv->config->loopcache && loop.length > 0 && loop.length <= loopcachemax &&
+        priv->length > loop.start + 2 * loop.length;
+    loop.state = cacheable ? loop_cache::State::capture : loop_cache::State::off;
+}
+
+// Looks up the rendered track in the cache, otherwise prepares to store it.
+// It waits for the first read from the start, since scans and prewarming
+// open tracks without playing them, and the key hashes the whole file.
+static void vgm_pcm_open(vgm_private *priv)
+{
+    const vgm_config &config = *priv->config;
+    if (config.pcmcachedir.empty())
+        return;
+
+    // key on the file contents, and all settings which affect the rendering
+    DATA_LOADER *loader = priv->loader.get();
+    UINT64 key = pcm_cache::hash(DataLoader_GetData(loader), DataLoader_GetSize(loader));
+    const UINT32 settings[] = { config.maxloops, samplerate };
+    key = pcm_cache::hash(settings, sizeof(settings), key);
+
+    char name[32];
+    sprintf(name, "/%016llx.vgmpcm", (unsigned long long)key);
+    priv->pcm_path = config.pcmcachedir + name;
+
+    std::unique_ptr<pcm_cache::reader> reader(new pcm_cache::reader);
+    if (reader->open(priv->pcm_path) && reader->frames() > 0 && reader->frames() <= priv->length) {
+        d_print("using cached rendering: %s\n", priv->pcm_path.c_str());
+        pcm_cache::touch(priv->pcm_path);
+        priv->pcm_reader = std::move(reader);
+        vgm_loop_disable(priv->loop);
+        return;
+    }
+
+    std::unique_ptr<pcm_cache::writer> writer(new pcm_cache::writer);
+    if (writer->open(config.pcmcachedir))
+        priv->pcm_writer = std::move(writer);
+}
+
+// stores the frames of the first full play into the cache
+static void vgm_pcm_feed(vgm_private *priv, UINT64 pos, const WAVE_32BS *data, UINT32 count)
+{
+    pcm_cache::writer *writer = priv->pcm_writer.get();
+    if (!writer || priv->pcm_complete)
+        return;
+
+    if (pos != writer->frames() || !writer->write(data, count)) {
+        priv->pcm_writer.reset();
+        return;
+    }
+
+    bool atend = priv->state == vgm_private::State::atend && priv->player->GetLoopTicks() == 0;
+    if (writer->frames() >= priv->length || atend)
+        priv->pcm_complete = true;
+}
+
+// stores a full play on close, away from the reads: the last block is
+// compressed, and the directory is pruned to its size
+static void vgm_pcm_close(vgm_private *priv)
+{
+    pcm_cache::writer *writer = priv->pcm_writer.get();
+    if (!writer || !priv->pcm_complete)
+        return;
+
+    const vgm_config &config = *priv->config;
+    if (writer->commit(priv->pcm_path)) {
+        d_print("stored rendering: %s\n", priv->pcm_path.c_str());
+        if (config.pcmcachesize > 0)
+            pcm_cache::prune(config.pcmcachedir, config.pcmcachesize);
+    }
+    priv->pcm_writer.reset();
+}
+
 static UINT8 vgm_play_callback(PlayerBase *player, void *user_param, UINT8 evt_type, void *evt_param)
 {
     vgm_private *priv = (vgm_private *)user_param;
 
     switch (evt_type) {
-    case PLREVT_LOOP: {
-        UINT32 curloop = *(UINT32 *)evt_param;
-        if (curloop >= maxloops)
-            priv->state = vgm_private::State::atend;
-        break;
-    }
     case PLREVT_END:
         priv->state = vgm_private::State::atend;
         break;
@@ -178,41 +649,632 @@ static UINT8 vgm_play_callback(PlayerBase *player, void *user_param, UINT8 evt_t
     return 0;
 }
 
+//------------------------------------------------------------------------------
+// Prewarming: when a track nears its end, the file which is likely to play
+// next is opened in the background and started, so the next `vgm_open` can
+// take it over and start without a gap.
+//
+// The plugin does not see the playlist of the host, so it guesses the next
+// file by name order, listing the directory in the worker. The guess is
+// checked against the next track which is played after the guessing one
+// closes, so the opens of library scans, which read no audio, do not count.
+// When another file plays than the guess, as with shuffle, prewarming pauses
+// until a guess is right again; the guesses go on being checked, which only
+// costs a directory listing in the worker.
+
+struct prewarm_entry {
+    std::string filename;
+    struct stat st;
+    std::unique_ptr<vgm_private> priv;
+    sample_format_t sf;
+    channel_position_t channel_map[CHANNELS_MAX];
+};
+
+struct prewarm_pool {
+    std::mutex mutex;
+    std::list<prewarm_entry> ready;
+    std::vector<std::string> pending;
+    std::string guess; // next file guessed for the track which is playing
+    bool guess_due = false; // the guessing track closed, the next play checks it
+    bool guess_missed = false;
+    UINT64 hits = 0;
+    UINT64 misses = 0;
+    static constexpr size_t max_entries = 2;
+};
+
+static prewarm_pool &prewarm_pool_instance()
+{
+    // never destroyed, since detached workers may outlive the static objects
+    static prewarm_pool &pool = *new prewarm_pool;
+    return pool;
+}
+
+static bool vgm_has_extension(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    if (!ext || strchr(ext, '/'))
+        return false;
+    for (const char *const *e = ip_extensions; *e; ++e) {
+        if (!strcasecmp(ext + 1, *e))
+            return true;
+    }
+    return false;
+}
+
+static bool vgm_file_same(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+        a.st_size == b.st_size && a.st_mtime == b.st_mtime;
+}
+
+// guesses the next track of an album, the next playable file by name order
+static bool vgm_next_file(const char *filename, std::string &next)
+{
+    const char *slash = strrchr(filename, '/');
+    std::string dirname = slash ? std::string(filename, slash + 1) : std::string("./");
+    const char *basename = slash ? slash + 1 : filename;
+
+    struct Dir_Deleter { void operator()(DIR *x) { closedir(x); } };
+    std::unique_ptr<DIR, Dir_Deleter> dir(opendir(dirname.c_str()));
+    if (!dir)
+        return false;
+
+    std::string best;
+    while (dirent *ent = readdir(dir.get())) {
+        const char *name = ent->d_name;
+        if (strcmp(name, basename) > 0 && (best.empty() || strcmp(name, best.c_str()) < 0) &&
+            vgm_has_extension(name))
+            best.assign(name);
+    }
+    if (best.empty())
+        return false;
+
+    next = dirname + best;
+    return true;
+}
+
+static void vgm_prewarm_load(std::string filename)
+{
+    prewarm_pool &pool = prewarm_pool_instance();
+
+    std::unique_ptr<prewarm_entry> entry(new prewarm_entry);
+    entry->filename = filename;
+
+    input_plugin_data ip_data;
+    memset(&ip_data, 0, sizeof(ip_data));
+    ip_data.filename = &filename[0];
+    ip_data.fd = -1;
+
+    bool ok = false;
+    try {
+        if (stat(filename.c_str(), &entry->st) == 0 &&
+            (ip_data.fd = open(filename.c_str(), O_RDONLY)) != -1 &&
+            vgm_open_file(&ip_data) == 0)
+        {
+            vgm_private *priv = (vgm_private *)ip_data.priv;
+            entry->priv.reset(priv);
+            // the preroll is stereo, and would advance only the first stem
+            if (priv->stems.empty()) {
+                // render the first block ahead of time
+                std::vector<WAVE_32BS> preroll(maxrender);
+                preroll.resize(vgm_render(priv, maxrender, preroll.data()));
+                priv->preroll = std::move(preroll);
+                vgm_memory_enforce(priv);
+                entry->sf = ip_data.sf;
+                channel_map_copy(entry->channel_map, ip_data.channel_map);
+                ok = true;
+            }
+        }
+    }
+    catch (std::exception &) {
+    }
+
+    if (ip_data.fd != -1)
+        close(ip_data.fd);
+
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.pending.erase(std::remove(pool.pending.begin(), pool.pending.end(), filename), pool.pending.end());
+    if (ok) {
+        pool.ready.push_front(std::move(*entry));
+        if (pool.ready.size() > prewarm_pool::max_entries)
+            pool.ready.pop_back();
+    }
+}
+
+// guesses the track after the given one, and loads it unless paused
+static void vgm_prewarm_thread(std::string current)
+{
+    prewarm_pool &pool = prewarm_pool_instance();
+
+    std::string next;
+    if (!vgm_next_file(current.c_str(), next))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.guess = next;
+        if (pool.guess_missed)
+            return;
+        if (std::find(pool.pending.begin(), pool.pending.end(), next) != pool.pending.end())
+            return;
+        for (const prewarm_entry &entry : pool.ready) {
+            if (entry.filename == next)
+                return;
+        }
+        pool.pending.push_back(next);
+    }
+
+    d_print("prewarming: %s\n", next.c_str());
+    vgm_prewarm_load(next);
+}
+
+static void vgm_prewarm_next(const char *filename)
+{
+    if (!vgm_memory_available())
+        return;
+
+    prewarm_pool &pool = prewarm_pool_instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.guess.clear();
+    pool.guess_due = false;
+
+    try {
+        std::thread(&vgm_prewarm_thread, std::string(filename)).detach();
+    }
+    catch (std::exception &) {
+    }
+}
+
+// called when a track which made a guess closes
+static void vgm_prewarm_closed()
+{
+    prewarm_pool &pool = prewarm_pool_instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.guess_due = !pool.guess.empty();
+}
+
+// called on the first read of a track, checks the guess made before it
+static void vgm_prewarm_check(const char *filename)
+{
+    prewarm_pool &pool = prewarm_pool_instance();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    if (!pool.guess_due)
+        return;
+    pool.guess_missed = pool.guess != filename;
+    ++(pool.guess_missed ? pool.misses : pool.hits);
+    pool.guess.clear();
+    pool.guess_due = false;
+}
+
+static bool vgm_prewarm_take(input_plugin_data *ip_data)
+{
+    prewarm_pool &pool = prewarm_pool_instance();
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    auto it = pool.ready.begin();
+    while (it != pool.ready.end() && it->filename != ip_data->filename)
+        ++it;
+    if (it == pool.ready.end())
+        return false;
+
+    prewarm_entry entry = std::move(*it);
+    pool.ready.erase(it);
+    lock.unlock();
+
+    if (entry.priv->config != vgm_config_get())
+        return false; // options changed since
+
+    struct stat st;
+    if (stat(ip_data->filename, &st) != 0 || !vgm_file_same(st, entry.st))
+        return false;
+
+    ip_data->priv = entry.priv.release();
+    ip_data->sf = entry.sf;
+    channel_map_copy(ip_data->channel_map, entry.channel_map);
+    return true;
+}
+
+// drops the prewarmed tracks which have not been taken yet
+static void vgm_prewarm_drop()
+{
+    std::list<prewarm_entry> ready;
+    {
+        prewarm_pool &pool = prewarm_pool_instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        ready.swap(pool.ready);
+    }
+    if (!ready.empty())
+        d_print("dropping %u prewarmed tracks\n", (unsigned)ready.size());
+}
+
+//------------------------------------------------------------------------------
+// Memory accounting: each instance counts the buffers it holds, and the counts
+// are summed process-wide. The memory of the players and chips is not visible
+// from the outside, and file mappings are not counted, being backed by files.
+// The inflate state of a VGZ lives only while loading, so it is counted in the
+// check which precedes the loading, with the declared size of the file.
+// Over the budget, the plugin drops prewarmed tracks, then disables the caches
+// of the track which is playing, and refuses to open any more tracks.
+
+struct memory_account {
+    std::atomic<UINT64> used {0};
+    std::atomic<UINT64> degraded {0};
+    std::atomic<UINT64> refused {0};
+};
+
+static memory_account memory_total;
+
+static size_t vgm_memory_footprint(const vgm_private *priv)
+{
+    size_t size = sizeof(vgm_private);
+    if (priv->loader && !priv->loader_mapped)
+        size += DataLoader_GetSize(priv->loader.get());
+    size += priv->loop.frames.capacity() * sizeof(WAVE_32BS);
+    size += priv->preroll.capacity() * sizeof(WAVE_32BS);
+    size += priv->stem_buffer.capacity() * sizeof(WAVE_32BS);
+    if (priv->pcm_reader)
+        size += pcm_cache::block_frames * sizeof(WAVE_32BS);
+    if (priv->pcm_writer) // the block, and its compressed copy
+        size += 2 * pcm_cache::block_frames * sizeof(WAVE_32BS);
+    return size;
+}
+
+static void vgm_memory_update(vgm_private *priv)
+{
+    size_t size = vgm_memory_footprint(priv);
+    memory_total.used += size;
+    memory_total.used -= priv->memory;
+    priv->memory = size;
+}
+
+static void vgm_memory_release(vgm_private *priv)
+{
+    memory_total.used -= priv->memory;
+    priv->memory = 0;
+}
+
+static bool vgm_memory_available()
+{
+    UINT64 budget = vgm_config_get()->memorybudget;
+    return budget == 0 || memory_total.used < budget;
+}
+
+// tells whether the given size can be added to the total within the budget
+static bool vgm_memory_fits(vgm_private *priv, UINT64 size)
+{
+    UINT64 budget = priv->config->memorybudget;
+    if (budget == 0 || memory_total.used + size <= budget)
+        return true;
+
+    vgm_prewarm_drop();
+    if (memory_total.used + size <= budget)
+        return true;
+
+    d_print("memory over budget, refusing to open\n");
+    ++memory_total.refused;
+    return false;
+}
+
+// accounts a track which was just opened, and tells whether it fits the budget
+static bool vgm_memory_admit(vgm_private *priv)
+{
+    vgm_memory_update(priv);
+    return vgm_memory_fits(priv, 0);
+}
+
+// accounts a track during playback, and gives up its caches if over budget
+static void vgm_memory_enforce(vgm_private *priv)
+{
+    vgm_memory_update(priv);
+
+    UINT64 budget = priv->config->memorybudget;
+    if (budget == 0)
+        return;
+
+    // the loop capture allocates its buffer at once on the first frame
+    const loop_cache &loop = priv->loop;
+    UINT64 pending = 0;
+    if (loop.state == loop_cache::State::capture && loop.frames.empty())
+        pending = loop.length * sizeof(WAVE_32BS);
+    if (memory_total.used + pending <= budget)
+        return;
+
+    vgm_prewarm_drop();
+    if (memory_total.used + pending <= budget)
+        return;
+
+    if (loop.state != loop_cache::State::off || priv->pcm_writer) {
+        d_print("memory over budget, disabling the caches of the track\n");
+        ++memory_total.degraded;
+        vgm_loop_disable(priv->loop);
+        priv->pcm_writer.reset();
+        vgm_memory_update(priv);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Profiling: the render cost of each track is aggregated by the set of chips
+// it plays, identified by type and emulation core.
+
+struct profile_registry {
+    std::mutex mutex;
+    std::map<std::string, render_profile> profiles;
+};
+
+static profile_registry &profile_registry_instance()
+{
+    static profile_registry &registry = *new profile_registry;
+    return registry;
+}
+
+static std::string vgm_chips_key(const PlayerBase &player)
+{
+    std::vector<PLR_DEV_INFO> devices;
+    player.GetSongDeviceInfo(devices);
+
+    std::string key;
+    for (const PLR_DEV_INFO &dev : devices) {
+        const char *name = SndEmu_GetDevName(dev.type, 0x00, nullptr);
+        char core[5] = {};
+        for (unsigned i = 0; i < 4; ++i)
+            core[i] = (dev.core >> (24 - 8 * i)) & 0xff;
+        for (unsigned i = 4; i-- > 0 && (core[i] == ' ' || core[i] == '\0');)
+            core[i] = '\0';
+        if (!key.empty())
+            key.push_back('+');
+        key.append(name ? name : "unknown");
+        key.push_back(':');
+        key.append(core[0] ? core : "default");
+    }
+    return key.empty() ? std::string("none") : key;
+}
+
+static void vgm_profile_commit(vgm_private *priv)
+{
+    render_profile &profile = *priv->profile;
+    if (profile.frames == 0)
+        return;
+    profile.tracks = 1;
+
+    std::string key = vgm_chips_key(*priv->player);
+    std::string json;
+    profile.append_json(json);
+    d_print("profile of %s: %s\n", key.c_str(), json.c_str());
+
+    profile_registry &registry = profile_registry_instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.profiles[key].merge(profile);
+}
+
+//------------------------------------------------------------------------------
 static int vgm_close(input_plugin_data *ip_data)
 {
     d_print("vgm_close(%p)\n", ip_data);
 
     vgm_private *priv = (vgm_private *)ip_data->priv;
-    PlayerBase *player = priv->player.get();
 
-    if (player) {
-        player->Stop();
-        player->UnloadFile();
-    }
+    // the profile and the rendering are stored now, which can fail on its
+    // own; the track is closed regardless
+    int ret = 0;
+    if (priv->profile)
+        ret = vgm_guard("vgm_close", ip_data, [priv]() { vgm_profile_commit(priv); return 0; });
+    int pcmret = vgm_guard("vgm_close", ip_data, [priv]() { vgm_pcm_close(priv); return 0; });
+    if (ret == 0)
+        ret = pcmret;
+    if (priv->prewarm_requested)
+        vgm_prewarm_closed();
 
     delete priv;
     ip_data->priv = nullptr;
-    return 0;
+    return ret;
 }
 
-static int vgm_read(input_plugin_data *ip_data, char *buffer, int count)
+static void vgm_loop_disable(loop_cache &loop)
 {
-    d_print("vgm_read(%p, %d)\n", ip_data, count);
+    loop.state = loop_cache::State::off;
+    std::vector<WAVE_32BS>().swap(loop.frames);
+}
+
+static void vgm_loop_feed(loop_cache &loop, UINT64 pos, const WAVE_32BS *data, UINT32 count)
+{
+    if (loop.state != loop_cache::State::capture)
+        return;
+
+    UINT64 end = std::min(pos + count, loop.start + 2 * loop.length);
+    if (end <= loop.next)
+        return;
+    if (pos > loop.next) { // missed some frames
+        vgm_loop_disable(loop);
+        return;
+    }
+
+    if (loop.frames.empty())
+        loop.frames.resize(loop.length);
 
+    for (UINT64 p = loop.next; p < end;) {
+        UINT64 index = p - loop.start;
+        const WAVE_32BS *src = &data[p - pos];
+        if (index < loop.length) { // first pass: capture
+            UINT64 n = std::min(end, loop.start + loop.length) - p;
+            std::copy_n(src, n, &loop.frames[index]);
+            p += n;
+        }
+        else { // second pass: verify
+            UINT64 n = end - p;
+            if (memcmp(src, &loop.frames[index - loop.length], n * sizeof(WAVE_32BS)) != 0) {
+                vgm_loop_disable(loop);
+                return;
+            }
+            p += n;
+        }
+    }
+
+    loop.next = end;
+    if (end == loop.start + 2 * loop.length) {
+        d_print("loop is periodic, replaying %lu frames\n", (unsigned long)loop.length);
+        loop.state = loop_cache::State::replay;
+    }
+}
+
+static UINT32 vgm_loop_replay(const loop_cache &loop, UINT64 pos, WAVE_32BS *data, UINT32 count)
+{
+    UINT32 got = 0;
+    while (got < count) {
+        UINT64 index = (pos + got - loop.start) % loop.length;
+        UINT32 n = std::min<UINT64>(count - got, loop.length - index);
+        std::copy_n(&loop.frames[index], n, &data[got]);
+        got += n;
+    }
+    return got;
+}
+
+// Renders by calls of `render(offset, count)`. With a time budget, it renders
+// in chunks sized from the measured cost per frame, and returns early when
+// time runs out.
+template <class Render>
+static UINT32 vgm_render_budgeted(vgm_private *priv, UINT32 want, Render render)
+{
+    UINT32 budget = priv->config->renderbudget;
+    if (budget == 0)
+        return render(0, want);
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point now = clock::now();
+    clock::time_point deadline = now + std::chrono::milliseconds(budget);
+
+    UINT32 got = 0;
+    while (got < want) {
+        double remain = std::chrono::duration<double>(deadline - now).count();
+        if (got > 0 && remain <= 0)
+            break;
+
+        UINT32 chunk = want - got;
+        if (priv->frame_cost > 0)
+            chunk = std::min<double>(chunk, std::max<double>(minrender, remain / priv->frame_cost));
+
+        UINT32 count = render(got, chunk);
+        clock::time_point then = now;
+        now = clock::now();
+
+        if (count > 0) {
+            double cost = std::chrono::duration<double>(now - then).count() / count;
+            priv->frame_cost = (priv->frame_cost > 0) ? (0.75 * priv->frame_cost + 0.25 * cost) : cost;
+        }
+
+        got += count;
+        if (count < chunk)
+            break;
+    }
+
+    return got;
+}
+
+// runs an emulation, and records its time in the profile if there is one
+template <class Render>
+static UINT32 vgm_render_profiled(vgm_private *priv, Render render)
+{
+    if (!priv->profile)
+        return render();
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    UINT32 got = render();
+    priv->profile->add(std::chrono::duration<double>(clock::now() - start).count(), got);
+    return got;
+}
+
+static UINT32 vgm_render_player(vgm_private *priv, UINT32 want, WAVE_32BS *data)
+{
+    PlayerBase &player = *priv->player;
+    std::fill(data, data + want, WAVE_32BS());
+
+    return vgm_render_budgeted(priv, want, [&](UINT32 offset, UINT32 count) {
+        return player.Render(count, &data[offset]);
+    });
+}
+
+static UINT32 vgm_stems_render(vgm_private *priv, UINT32 want, INT32 *data)
+{
+    unsigned channels = 2 * (1 + priv->stems.size());
+
+    return vgm_render_profiled(priv, [&]() {
+        return vgm_render_budgeted(priv, want, [&](UINT32 offset, UINT32 count) {
+            return vgm_stems_render_chunk(priv, count, &data[offset * channels]);
+        });
+    });
+}
+
+// produces the raw frames at the current position
+static UINT32 vgm_render(vgm_private *priv, UINT32 want, WAVE_32BS *data)
+{
+    UINT64 pos = priv->position;
+    loop_cache &loop = priv->loop;
+
+    if (priv->preroll_pos < priv->preroll.size()) {
+        UINT32 got = std::min<size_t>(want, priv->preroll.size() - priv->preroll_pos);
+        std::copy_n(&priv->preroll[priv->preroll_pos], got, data);
+        priv->preroll_pos += got;
+        vgm_pcm_feed(priv, pos, data, got);
+        return got;
+    }
+
+    if (priv->pcm_reader)
+        return priv->pcm_reader->read(pos, data, want);
+
+    UINT32 got;
+    if (loop.state == loop_cache::State::replay && pos >= loop.start)
+        got = vgm_loop_replay(loop, pos, data, want);
+    else {
+        got = vgm_render_profiled(priv, [&]() { return vgm_render_player(priv, want, data); });
+        vgm_loop_feed(loop, pos, data, got);
+    }
+
+    vgm_pcm_feed(priv, pos, data, got);
+    return got;
+}
+
+static int vgm_read_frames(input_plugin_data *ip_data, char *buffer, int count)
+{
     vgm_private *priv = (vgm_private *)ip_data->priv;
     PlayerBase &player = *priv->player;
 
+    UINT64 pos = priv->position;
+    if (pos >= priv->length)
+        return 0;
+
     bool atend = priv->state == vgm_private::State::atend;
     if (atend && player.GetLoopTicks() == 0)
         return 0; // if not a looped song, just stop right here
 
-    int want = count / sizeof(WAVE_32BS);
+    int channels = 2 * (1 + priv->stems.size());
+    int framesize = channels * sizeof(INT32);
+    int want = count / framesize;
     if (want > maxrender) want = maxrender;  // workaround for libvgm internal limit
+    if ((UINT64)want > priv->length - pos) want = priv->length - pos;
+
+    if (!priv->played) {
+        priv->played = true;
+        vgm_prewarm_check(ip_data->filename);
+    }
+    if (!priv->pcm_opened && pos == 0 && priv->stems.empty()) {
+        priv->pcm_opened = true;
+        vgm_pcm_open(priv);
+    }
+    vgm_memory_enforce(priv);
+
+    int got;
+    if (priv->stems.empty())
+        got = vgm_render(priv, want, (WAVE_32BS *)buffer);
+    else
+        got = vgm_stems_render(priv, want, (INT32 *)buffer);
 
-    std::fill(buffer, buffer + want * sizeof(WAVE_32BS), 0);
-    int got = player.Render(want, (WAVE_32BS *)buffer);
+    // prewarming renders stereo only, a track of several chips would open as stems
+    if (!priv->prewarm_requested && priv->config->prewarm && !priv->config->stems && priv->length - pos < prewarmlead * samplerate) {
+        priv->prewarm_requested = true;
+        vgm_prewarm_next(ip_data->filename);
+    }
 
-    for (int i = 0; i < 2 * got; ++i) {
+    for (int i = 0; i < channels * got; ++i) {
         INT32 *dst = (INT32 *)(buffer + i * sizeof(int32_t));
 
         INT32 smpl = *dst;
@@ -232,36 +1294,125 @@ static int vgm_read(input_plugin_data *ip_data, char *buffer, int count)
         *dst = smpl;
     }
 
-    if (atend) { // if a looped song, smoothly turn down the volume
+    if (pos + got > priv->play_length) { // if a looped song, smoothly turn down the volume
         double vol = priv->volume;
-        for (int i = 0; i < got; ++i) {
-            WAVE_32BS *dst = &((WAVE_32BS *)buffer)[i];
+        int start = (pos < priv->play_length) ? (int)(priv->play_length - pos) : 0;
+        for (int i = start; i < got; ++i) {
+            INT32 *dst = &((INT32 *)buffer)[i * channels];
             vol *= fadefactor;
-            dst->L = (INT32)std::lround(vol * dst->L);
-            dst->R = (INT32)std::lround(vol * dst->R);
-            if (vol < 1e-4) { got = i; break; }
+            for (int c = 0; c < channels; ++c)
+                dst[c] = (INT32)std::lround(vol * dst[c]);
         }
         priv->volume = vol;
     }
 
-    return got * sizeof(WAVE_32BS);
+    priv->position = pos + got;
+    return got * framesize;
 }
 
-static int vgm_seek(input_plugin_data *ip_data, double offset)
+static int vgm_read(input_plugin_data *ip_data, char *buffer, int count)
 {
-    d_print("vgm_seek(%p)\n", ip_data);
+    d_print("vgm_read(%p, %d)\n", ip_data, count);
+
+    // the caches grow while playing, as the loop capture does
+    return vgm_guard("vgm_read", ip_data, [=]() { return vgm_read_frames(ip_data, buffer, count); });
+}
+
+// Moves the player to a frame. The player seeks by processing the commands up
+// to the target without rendering, so going forward continues from where it
+// is, and only going backward, or past the end, restarts from the beginning.
+static void vgm_player_seek(PlayerBase &player, UINT64 pos, bool atend)
+{
+    if (atend || pos < player.GetCurPos(PLAYPOS_SAMPLE))
+        player.Reset();
+    player.Seek(PLAYPOS_SAMPLE, pos);
+}
 
+static int vgm_seek_to(input_plugin_data *ip_data, double offset)
+{
     vgm_private *priv = (vgm_private *)ip_data->priv;
     PlayerBase &player = *priv->player;
 
+    UINT64 pos = std::min<UINT64>(std::llround(std::max(0.0, offset) * samplerate), priv->length);
+
+    bool atend = priv->state == vgm_private::State::atend;
     priv->state = vgm_private::State::started;
-    priv->volume = 1;
-    player.Reset();
-    player.Seek(PLAYPOS_SAMPLE, std::lround(offset * samplerate));
+    priv->volume = (pos > priv->play_length) ? std::pow(fadefactor, pos - priv->play_length) : 1;
+    priv->position = pos;
+    priv->preroll.clear();
+    priv->preroll_pos = 0;
+
+    if (priv->pcm_reader)
+        return 0; // served from the rendering cache, the player is not needed
+    if (!priv->pcm_complete)
+        priv->pcm_writer.reset(); // no longer a full play
+
+    loop_cache &loop = priv->loop;
+    if (loop.state == loop_cache::State::replay && pos >= loop.start)
+        return 0; // served from the loop cache, the player is not needed
+    if (loop.state == loop_cache::State::capture) {
+        // a seek can alter the state of chips, so capture again from the start
+        if (pos <= loop.start)
+            loop.next = loop.start;
+        else
+            vgm_loop_disable(loop);
+    }
+
+    vgm_player_seek(player, pos, atend);
+    for (std::unique_ptr<PlayerBase> &other : priv->stems)
+        vgm_player_seek(*other, pos, atend);
 
     return 0;
 }
 
+static int vgm_seek(input_plugin_data *ip_data, double offset)
+{
+    d_print("vgm_seek(%p)\n", ip_data);
+
+    return vgm_guard("vgm_seek", ip_data, [=]() { return vgm_seek_to(ip_data, offset); });
+}
+
+// Estimates the processor cost of the track, as the fraction of real time its
+// emulation takes, by timing a short render on a separate player. The render
+// starts at the middle of the track, since many open with a silent intro,
+// which costs less. It returns a negative value if it cannot render.
+static double vgm_estimate_cost(vgm_private *priv)
+{
+    DATA_LOADER *loader = priv->loader.get();
+    std::unique_ptr<PlayerBase> player(vgm_player_for(loader));
+    if (!player)
+        return -1;
+
+    double cost = -1;
+    if (player->LoadFile(loader) == 0) {
+        player->SetSampleRate(samplerate);
+        player->Start();
+        player->Seek(PLAYPOS_SAMPLE, player->Tick2Sample(player->GetTotalTicks()) / 2);
+
+        typedef std::chrono::steady_clock clock;
+        std::unique_ptr<WAVE_32BS[]> buffer(new WAVE_32BS[maxrender]);
+        UINT32 frames = 0;
+        clock::time_point start = clock::now();
+        while (frames < calibrationlength) {
+            UINT32 want = std::min(maxrender, calibrationlength - frames);
+            std::fill(&buffer[0], &buffer[want], WAVE_32BS());
+            UINT32 got = player->Render(want, buffer.get());
+            frames += got;
+            if (got < want)
+                break;
+        }
+        double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+        if (frames > 0)
+            cost = elapsed * samplerate / frames;
+        player->Stop();
+        player->UnloadFile();
+    }
+
+    vgm_player_release(std::move(player));
+    return cost;
+}
+
 static int vgm_read_comments(input_plugin_data *ip_data, struct keyval **comments)
 {
     d_print("vgm_read_comments(%p)\n", ip_data);
@@ -278,7 +1429,7 @@ static int vgm_read_comments(input_plugin_data *ip_data, struct keyval **comment
     const char *system = NULL;
 
     const char *const *tags = player.GetTags();
-    for (const char *const *t = tags; *t; t += 2) {
+    for (const char *const *t = tags; t && t[0] && t[1]; t += 2) {
         if (!strcmp(t[0], "TITLE"))
             title = t[1];
         else if (!strcmp(t[0], "ARTIST"))
@@ -306,6 +1457,17 @@ static int vgm_read_comments(input_plugin_data *ip_data, struct keyval **comment
     if (system && system[0])
         comments_add_const(&c, "genre", system);
 
+    // not a standard tag, so added as is, and saved with the others by the host;
+    // left out if the estimate fails, rather than lose the tags gathered above;
+    // measured even when a rendering is cached, as the host keeps the tags
+    double cost = -1;
+    vgm_guard("vgm_read_comments", ip_data, [&]() { cost = vgm_estimate_cost(priv); return 0; });
+    if (cost >= 0) {
+        char value[32];
+        sprintf(value, "%.4f", cost);
+        keyvals_add(&c, "vgm_render_cost", xstrdup(value));
+    }
+
     keyvals_terminate(&c);
     *comments = c.keyvals;
 
@@ -317,9 +1479,8 @@ static int vgm_duration(input_plugin_data *ip_data)
     d_print("vgm_duration(%p)\n", ip_data);
 
     vgm_private *priv = (vgm_private *)ip_data->priv;
-    PlayerBase &player = *priv->player;
 
-    return player.Tick2Second(player.GetTotalPlayTicks(maxloops));
+    return std::min<UINT64>((priv->length + samplerate / 2) / samplerate, INT_MAX);
 }
 
 static long vgm_bitrate(input_plugin_data *ip_data)
@@ -344,26 +1505,237 @@ static char *vgm_codec_profile(input_plugin_data *ip_data)
 }
 
 //------------------------------------------------------------------------------
-static int vgm_set_maxloops(const char *val)
+static bool vgm_parse_uint(const char *val, unsigned &num)
 {
-    unsigned num;
     unsigned size;
     if (sscanf(val, "%u%n", &num, &size) != 1 || strlen(val) != size) {
         errno = EINVAL;
-        return -IP_ERROR_ERRNO;
+        return false;
     }
-    maxloops = num;
+    return true;
+}
+
+static bool vgm_parse_bool(const char *val, bool &flag)
+{
+    if (!strcmp(val, "true") || !strcmp(val, "1"))
+        flag = true;
+    else if (!strcmp(val, "false") || !strcmp(val, "0"))
+        flag = false;
+    else {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+static int vgm_set_maxloops(const char *val)
+{
+    unsigned num;
+    if (!vgm_parse_uint(val, num))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([num](vgm_config &config) { config.maxloops = num; });
     return 0;
 }
 
 static int vgm_get_maxloops(char **val)
 {
     char str[32];
-    sprintf(str, "%u", maxloops);
+    sprintf(str, "%u", vgm_config_get()->maxloops);
     *val = xstrdup(str);
     return 0;
 }
 
+static int vgm_set_pcmcachedir(const char *val)
+{
+    std::string dir(val);
+    while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    vgm_config_update([&dir](vgm_config &config) { config.pcmcachedir = dir; });
+    return 0;
+}
+
+static int vgm_get_pcmcachedir(char **val)
+{
+    *val = xstrdup(vgm_config_get()->pcmcachedir.c_str());
+    return 0;
+}
+
+static int vgm_set_pcmcachesize(const char *val)
+{
+    unsigned num;
+    if (!vgm_parse_uint(val, num))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([num](vgm_config &config) { config.pcmcachesize = (UINT64)num << 20; });
+    return 0;
+}
+
+static int vgm_get_pcmcachesize(char **val)
+{
+    char str[32];
+    sprintf(str, "%u", (unsigned)(vgm_config_get()->pcmcachesize >> 20));
+    *val = xstrdup(str);
+    return 0;
+}
+
+static int vgm_set_renderbudget(const char *val)
+{
+    unsigned num;
+    if (!vgm_parse_uint(val, num))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([num](vgm_config &config) { config.renderbudget = num; });
+    return 0;
+}
+
+static int vgm_get_renderbudget(char **val)
+{
+    char str[32];
+    sprintf(str, "%u", vgm_config_get()->renderbudget);
+    *val = xstrdup(str);
+    return 0;
+}
+
+static int vgm_set_profile(const char *val)
+{
+    bool flag;
+    if (!vgm_parse_bool(val, flag))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([flag](vgm_config &config) { config.profile = flag; });
+    return 0;
+}
+
+static int vgm_get_profile(char **val)
+{
+    *val = xstrdup(vgm_config_get()->profile ? "true" : "false");
+    return 0;
+}
+
+static int vgm_set_profilejson(const char *val)
+{
+    return 0; // results are not restored from the configuration
+}
+
+static int vgm_get_profilejson(char **val)
+{
+    std::string json("{");
+
+    profile_registry &registry = profile_registry_instance();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (const auto &entry : registry.profiles) {
+        if (json.size() > 1)
+            json.push_back(',');
+        json.push_back('"');
+        json.append(entry.first);
+        json.append("\":");
+        entry.second.append_json(json);
+    }
+    json.push_back('}');
+
+    *val = xstrdup(json.c_str());
+    return 0;
+}
+
+static int vgm_set_stems(const char *val)
+{
+    bool flag;
+    if (!vgm_parse_bool(val, flag))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([flag](vgm_config &config) { config.stems = flag; });
+    return 0;
+}
+
+static int vgm_get_stems(char **val)
+{
+    *val = xstrdup(vgm_config_get()->stems ? "true" : "false");
+    return 0;
+}
+
+static int vgm_set_loopcache(const char *val)
+{
+    bool flag;
+    if (!vgm_parse_bool(val, flag))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([flag](vgm_config &config) { config.loopcache = flag; });
+    return 0;
+}
+
+static int vgm_get_loopcache(char **val)
+{
+    *val = xstrdup(vgm_config_get()->loopcache ? "true" : "false");
+    return 0;
+}
+
+static int vgm_set_prewarm(const char *val)
+{
+    bool flag;
+    if (!vgm_parse_bool(val, flag))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([flag](vgm_config &config) { config.prewarm = flag; });
+    if (!flag)
+        vgm_prewarm_drop();
+    return 0;
+}
+
+static int vgm_get_prewarm(char **val)
+{
+    *val = xstrdup(vgm_config_get()->prewarm ? "true" : "false");
+    return 0;
+}
+
+static int vgm_set_memorybudget(const char *val)
+{
+    unsigned num;
+    if (!vgm_parse_uint(val, num))
+        return -IP_ERROR_ERRNO;
+    vgm_config_update([num](vgm_config &config) { config.memorybudget = (UINT64)num << 20; });
+    return 0;
+}
+
+static int vgm_get_memorybudget(char **val)
+{
+    char str[32];
+    sprintf(str, "%u", (unsigned)(vgm_config_get()->memorybudget >> 20));
+    *val = xstrdup(str);
+    return 0;
+}
+
+static int vgm_set_stats(const char *val)
+{
+    return 0; // read-only, but accept the value which the host saves and restores
+}
+
+static int vgm_get_stats(char **val)
+{
+    std::string str;
+    char item[128];
+
+    {
+        player_pool &pool = player_pool_instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        UINT64 total = pool.hits + pool.misses;
+        sprintf(item, "pool=%u/%u pool_hits=%llu pool_misses=%llu pool_hit_rate=%.0f%%",
+                (unsigned)pool.players.size(), (unsigned)player_pool::max_players,
+                (unsigned long long)pool.hits, (unsigned long long)pool.misses,
+                total ? (100.0 * pool.hits / total) : 0.0);
+        str.append(item);
+    }
+
+    {
+        prewarm_pool &pool = prewarm_pool_instance();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        sprintf(item, " prewarm_hits=%llu prewarm_misses=%llu",
+                (unsigned long long)pool.hits, (unsigned long long)pool.misses);
+        str.append(item);
+    }
+
+    sprintf(item, " memory=%llu memory_budget=%llu memory_degraded=%llu memory_refused=%llu",
+            (unsigned long long)memory_total.used, (unsigned long long)vgm_config_get()->memorybudget,
+            (unsigned long long)memory_total.degraded, (unsigned long long)memory_total.refused);
+    str.append(item);
+
+    *val = xstrdup(str.c_str());
+    return 0;
+}
+
 //------------------------------------------------------------------------------
 const struct input_plugin_ops ip_ops = {
     .open = &vgm_open,
@@ -381,5 +1753,18 @@ const struct input_plugin_ops ip_ops = {
 const int ip_priority = 50;
 const char * const ip_extensions[] = { "vgm", "vgz", "s98", "dro", nullptr };
 const char * const ip_mime_types[] = { nullptr };
-const struct input_plugin_opt ip_options[] = { {"max_loops", &vgm_set_maxloops, &vgm_get_maxloops}, { nullptr } };
+const struct input_plugin_opt ip_options[] = {
+    {"max_loops", &vgm_set_maxloops, &vgm_get_maxloops},
+    {"pcm_cache_dir", &vgm_set_pcmcachedir, &vgm_get_pcmcachedir},
+    {"pcm_cache_size", &vgm_set_pcmcachesize, &vgm_get_pcmcachesize},
+    {"render_budget", &vgm_set_renderbudget, &vgm_get_renderbudget},
+    {"profile", &vgm_set_profile, &vgm_get_profile},
+    {"profile_json", &vgm_set_profilejson, &vgm_get_profilejson},
+    {"stems", &vgm_set_stems, &vgm_get_stems},
+    {"memory_budget", &vgm_set_memorybudget, &vgm_get_memorybudget},
+    {"loop_cache", &vgm_set_loopcache, &vgm_get_loopcache},
+    {"prewarm", &vgm_set_prewarm, &vgm_get_prewarm},
+    {"stats", &vgm_set_stats, &vgm_get_stats},
+    { nullptr }
+};
 const unsigned ip_abi_version = IP_ABI_VERSION;
@@ -0,0 +1,157 @@
+//          Copyright Jean Pierre Cimalando 2019.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// Round trips of the rendering cache: files written by `pcm_cache::writer`
+// of various lengths, whose block index lands at any alignment, must read
+// back identical through `pcm_cache::reader`, from any position.
+
+#include "pcm_cache.h"
+#include <random>
+#include <cstdio>
+#include <cstdlib>
+
+static int failures = 0;
+
+#define CHECK(x) do { if (!(x)) { fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #x); ++failures; } } while (0)
+
+static std::vector<WAVE_32BS> make_frames(UINT32 count, std::uint32_t seed)
+{
+    // a slow waveform with noise, so that blocks compress to varied sizes
+    std::minstd_rand random(seed);
+    std::vector<WAVE_32BS> frames(count);
+    for (UINT32 i = 0; i < count; ++i) {
+        frames[i].L = (INT32)((i * 37) % 65536) - 32768 + (INT32)(random() % 512);
+        frames[i].R = -frames[i].L + (INT32)(random() % 8);
+    }
+    return frames;
+}
+
+static bool same(const WAVE_32BS *a, const WAVE_32BS *b, UINT32 count)
+{
+    for (UINT32 i = 0; i < count; ++i) {
+        if (a[i].L != b[i].L || a[i].R != b[i].R)
+            return false;
+    }
+    return true;
+}
+
+static void round_trip(const std::string &dir, UINT32 count, std::uint32_t seed)
+{
+    std::vector<WAVE_32BS> frames = make_frames(count, seed);
+    std::string path = dir + "/track.vgmpcm";
+
+    pcm_cache::writer writer;
+    CHECK(writer.open(dir));
+    for (UINT32 pos = 0; pos < count;) {
+        UINT32 n = std::min<UINT32>(count - pos, 4096);
+        CHECK(writer.write(&frames[pos], n));
+        pos += n;
+    }
+    CHECK(writer.commit(path));
+
+    pcm_cache::reader reader;
+    CHECK(reader.open(path));
+    CHECK(reader.frames() == count);
+
+    std::vector<WAVE_32BS> out(count);
+    UINT32 got = 0;
+    while (got < count) {
+        UINT32 n = reader.read(got, &out[got], 3000);
+        if (n == 0)
+            break;
+        got += n;
+    }
+    CHECK(got == count);
+    CHECK(same(out.data(), frames.data(), count));
+
+    // seeks backward and across blocks
+    std::minstd_rand random(seed);
+    for (int i = 0; i < 20; ++i) {
+        UINT32 pos = random() % count;
+        WAVE_32BS buffer[1000];
+        UINT32 n = reader.read(pos, buffer, 1000);
+        CHECK(n == std::min<UINT32>(1000, count - pos));
+        CHECK(same(buffer, &frames[pos], n));
+    }
+
+    unlink(path.c_str());
+}
+
+static void truncated(const std::string &dir)
+{
+    std::vector<WAVE_32BS> frames = make_frames(100000, 7);
+    std::string path = dir + "/truncated.vgmpcm";
+
+    pcm_cache::writer writer;
+    CHECK(writer.open(dir));
+    CHECK(writer.write(frames.data(), frames.size()));
+    CHECK(writer.commit(path));
+    CHECK(truncate(path.c_str(), 1000) == 0);
+
+    pcm_cache::reader reader;
+    CHECK(!reader.open(path));
+    unlink(path.c_str());
+}
+
+static void prune(const std::string &dir)
+{
+    for (int i = 0; i < 4; ++i) {
+        std::string path = dir + "/" + std::to_string(i) + ".vgmpcm";
+        FILE *file = fopen(path.c_str(), "w");
+        CHECK(file && fwrite(std::string(1000, 'x').data(), 1, 1000, file) == 1000);
+        if (file)
+            fclose(file);
+        struct timespec times[2] = {{1000 + i, 0}, {1000 + i, 0}};
+        utimensat(AT_FDCWD, path.c_str(), times, 0);
+    }
+    pcm_cache::touch(dir + "/0.vgmpcm"); // the oldest becomes the most recent
+
+    // a temporary file which a writer holds, and another left by a crash
+    pcm_cache::writer writer;
+    CHECK(writer.open(dir));
+    std::string stale = dir + "/.vgmpcm.stale0";
+    FILE *file = fopen(stale.c_str(), "w");
+    if (file)
+        fclose(file);
+
+    pcm_cache::remove_stale(dir);
+    CHECK(access(stale.c_str(), F_OK) != 0);
+
+    pcm_cache::prune(dir, 2000);
+    CHECK(access((dir + "/0.vgmpcm").c_str(), F_OK) == 0);
+    CHECK(access((dir + "/1.vgmpcm").c_str(), F_OK) != 0);
+    CHECK(access((dir + "/2.vgmpcm").c_str(), F_OK) != 0);
+    CHECK(access((dir + "/3.vgmpcm").c_str(), F_OK) == 0);
+
+    writer.abort();
+    unlink((dir + "/0.vgmpcm").c_str());
+    unlink((dir + "/3.vgmpcm").c_str());
+}
+
+int main()
+{
+    char dirbuf[] = "/tmp/pcm_cache_test.XXXXXX";
+    if (!mkdtemp(dirbuf)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dirbuf;
+
+    // single frames, exact and partial blocks, and enough lengths that the
+    // index follows the blocks at each of the 8 alignments
+    const UINT32 counts[] = {1, 2, 4095, 65536, 65537, 131072, 200000};
+    for (UINT32 count : counts)
+        round_trip(dir, count, count);
+    for (std::uint32_t seed = 1; seed <= 16; ++seed)
+        round_trip(dir, 70000 + seed * 13, seed);
+
+    truncated(dir);
+    prune(dir);
+
+    rmdir(dir.c_str());
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures ? 1 : 0;
+}